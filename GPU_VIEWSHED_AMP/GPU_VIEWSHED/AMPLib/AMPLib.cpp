@@ -1,9 +1,12 @@
 #include "stdafx.h"
+#include "AMPLib.h"
 #include "amp.h"
 #include <amp_math.h>
 #include <algorithm> 
 #include <iostream>
 #include <cstdlib>
+#include <vector>
+#include <cfloat>
 
 
 #define RING_COUNTER 1
@@ -16,34 +19,72 @@
 #define EAST_SOUTH_EAST_COUNTER 1
 #define WEST_SOUTH_WEST_COUNTER 1
 
-#define XDRAW 1
-#define SDRAW 2
-#define DDA 3
-#define R3 4
-#define R2 5
+#define PATH_UNION 1
+#define PATH_COUNT 2
+#define PATH_PER_POSITION 3
+
+//Fixed point scales for the horizon outputs, so rays crossing the same cell can be merged
+//with an integer atomic min and give the same answer on every run
+#define HORIZON_ANGLE_SCALE 10000000.0f
+#define MIN_HEIGHT_SCALE 1000.0f
+#define HORIZON_UNSET 2147483647
+
+//Realisations traced per dispatch, one bit each in the per-cell mask
+#define REALISATION_BATCH 32
+
+//Coarsest level of detail pyramid level, blocks of 2^15 cells
+#define LOD_MAX_LEVELS 16
+
+//Longest side of the first, coarse, progressive pass when no level is given
+#define PROGRESSIVE_PREVIEW_SIZE 512
+
+//Work done between cancellation checks: rays per dispatch in the ray modes, XDRAW rings
+#define JOB_RAY_BATCH 1024
+#define XDRAW_CHECK_RINGS 16
+
+//Share of the accelerator's dedicated memory a batched XDRAW may take, the rest is left to the display
+#define XDRAW_BATCH_MEMORY_SHARE 2
 
 
 
 using namespace concurrency;
 
 
-void calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
-	int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
-	int rasterWidth, int rasterHeight)
+//Calls traceBatch(first, count) over rays 0 to rayCount - 1. With a job the rays go in batches
+//of JOB_RAY_BATCH, the job is checked before each and raysDone of rayTotal recorded after it;
+//without one they go in a single call.
+int traceInBatches(accelerator_view av, ViewshedJob* job, ULONGLONG startTicks, int rayCount, int &raysDone, int rayTotal,
+	const std::function<void(int, int)> &traceBatch)
 {
-	accelerator device(accelerator::default_accelerator);
-	accelerator_view av = device.default_view;
+	int batchSize = job != NULL ? JOB_RAY_BATCH : max(rayCount, 1);
 
-	extent<1> eY(zArrayLengthY);
-	extent<1> eX(zArrayLengthX);
-	const array_view<const float, 2> dataViewZ(zArrayLengthY, zArrayLengthX, &zArray[0, 0]);
-	array_view<int, 2> dataViewVisible(visibleArrayY, visibleArrayX, &visibleArray[0, 0]);
-	dataViewVisible.discard_data();
-	// Run code on the GPU
+	for (int first = 0; first < rayCount; first += batchSize)
+	{
+		int status = jobStatus(job, startTicks);
+		if (status != VIEWSHED_OK)
+		{
+			return status;
+		}
 
-	dataViewVisible(currX, currY) = 1;
+		int count = min(batchSize, rayCount - first);
+		traceBatch(first, count);
+		if (job != NULL)
+		{
+			av.wait();
+			raysDone += count;
+			jobProgress(job, raysDone, rayTotal);
+		}
+	}
+	return VIEWSHED_OK;
+}
 
-	parallel_for_each(av, eY, [=](index<1> idx) restrict(amp)
+
+//DDA rays from the observer to the West and East edge cells of rows first to first + count - 1
+void traceDDARows(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	TraceScope scope("dda rows", count);
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
 	{
 
 		int destX;
@@ -53,12 +94,12 @@ void calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
 			if (i == 0)
 			{
 				destX = 0;
-				destY = idx[0];
+				destY = first + idx[0];
 			}
 			else
 			{
 				destX = rasterWidth;
-				destY = rasterHeight - idx[0];
+				destY = rasterHeight - (first + idx[0]);
 			}
 
 
@@ -118,9 +159,20 @@ void calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		}
 
 	});
+	if (scope.active)
+	{
+		//so the event covers the rays rather than their submission
+		av.wait();
+	}
+}
 
 
-	parallel_for_each(av, eX, [=](index<1> idx) restrict(amp)
+//DDA rays from the observer to the South and North edge cells of columns first to first + count - 1
+void traceDDAColumns(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	TraceScope scope("dda columns", count);
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
 	{
 
 		int destX;
@@ -129,12 +181,12 @@ void calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		{
 			if (i == 0)
 			{
-				destX = idx[0];
+				destX = first + idx[0];
 				destY = 0;
 			}
 			else
 			{
-				destX = rasterWidth - idx[0];
+				destX = rasterWidth - (first + idx[0]);
 				destY = rasterHeight;
 			}
 
@@ -196,28 +248,279 @@ void calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		}
 
 	});
-
-
-
+	if (scope.active)
+	{
+		//so the event covers the rays rather than their submission
+		av.wait();
+	}
 }
 
-void calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
+
+//job may be null, otherwise the rays are batched and the job checked as in calcR3
+int calcDDA(float* zArray, int zArrayLengthX, int zArrayLengthY,
 	int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
-	int rasterWidth, int rasterHeight)
+	int rasterWidth, int rasterHeight, ViewshedJob* job)
 {
 	accelerator device(accelerator::default_accelerator);
 	accelerator_view av = device.default_view;
 
-	extent<1> eY(zArrayLengthY);
-	extent<1> eX(zArrayLengthX);
 	const array_view<const float, 2> dataViewZ(zArrayLengthY, zArrayLengthX, &zArray[0, 0]);
 	array_view<int, 2> dataViewVisible(visibleArrayY, visibleArrayX, &visibleArray[0, 0]);
 	dataViewVisible.discard_data();
 	// Run code on the GPU
+
 	dataViewVisible(currX, currY) = 1;
 
+	ULONGLONG startTicks = GetTickCount64();
+	int rayTotal = zArrayLengthX + zArrayLengthY;
+	int raysDone = 0;
+
+	int status = traceInBatches(av, job, startTicks, zArrayLengthY, raysDone, rayTotal, [&](int first, int count)
+	{
+		traceDDARows(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+	});
+	if (status != VIEWSHED_OK)
+	{
+		return status;
+	}
+	return traceInBatches(av, job, startTicks, zArrayLengthX, raysDone, rayTotal, [&](int first, int count)
+	{
+		traceDDAColumns(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+	});
+}
+
+
+//Walk one DDA ray in whole cell steps, keeping the horizon as a (height, squared distance) pair
+void traceRayExact(const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int destX, int destY) restrict(amp)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+
+	//previously highest LOS, a distance of 0 means nothing has been seen yet
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		//sample and mark the same snapped cell
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double dz = (double) dataViewZ(y, x) - currZ;
+
+		//cells exactly on the horizon count as visible
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			dataViewVisible(y, x) = 1;
+			highestZ = dz;
+			highestDistSq = distSq;
+		}
+	}
+}
+
+
+//traceRayExact that also records, for every cell, the elevation angle of the horizon in front
+//of it (radians) and how far above the ground a target there must be to be seen (metres)
+//Both are kept as the lowest value over all rays through the cell
+void traceRayHorizon(const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	const array_view<int, 2> &dataViewHorizon, const array_view<int, 2> &dataViewMinHeight,
+	int currX, int currY, int currZ, int destX, int destY) restrict(amp)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+
+	//previously highest LOS, a distance of 0 means nothing has been seen yet
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double dz = (double) dataViewZ(y, x) - currZ;
+
+		float horizonAngle = -1.5707963f;
+		float minHeight = 0.0f;
+
+		if (highestDistSq != 0)
+		{
+			horizonAngle = fast_math::atan2((float) highestZ, fast_math::sqrt((float) highestDistSq));
+			minHeight = fast_math::fmaxf(0.0f,
+				(float) highestZ * fast_math::sqrt((float) distSq / (float) highestDistSq) - (float) dz);
+		}
+
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			dataViewVisible(y, x) = 1;
+			highestZ = dz;
+			highestDistSq = distSq;
+			minHeight = 0.0f;
+		}
+
+		atomic_fetch_min(&dataViewHorizon(y, x), (int) (horizonAngle * HORIZON_ANGLE_SCALE));
+		atomic_fetch_min(&dataViewMinHeight(y, x), (int) fast_math::fminf(minHeight * MIN_HEIGHT_SCALE, 2147483520.0f));
+	}
+}
+
+//The exact comparisons convert float heights and int offsets to double, which limited double
+//precision hardware can't do, so fall back to WARP unless the card has full double support
+accelerator exactAccelerator()
+{
+	accelerator device(accelerator::default_accelerator);
+
+	if (!device.get_supports_double_precision())
+	{
+		device = accelerator(accelerator::direct3d_warp);
+	}
+	return device;
+}
+
+
+//Exact DDA rays to the West and East edge cells of rows first to first + count - 1
+void traceRowsExact(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
+	{
+		traceRayExact(dataViewZ, dataViewVisible, currX, currY, currZ, 0, first + idx[0]);
+		traceRayExact(dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth - 1, first + idx[0]);
+	});
+}
+
+
+//Exact DDA rays to the South and North edge cells of columns first to first + count - 1
+void traceColumnsExact(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
+	{
+		traceRayExact(dataViewZ, dataViewVisible, currX, currY, currZ, first + idx[0], 0);
+		traceRayExact(dataViewZ, dataViewVisible, currX, currY, currZ, first + idx[0], rasterHeight - 1);
+	});
+}
+
+
+//Trace an exact DDA ray to every edge cell of the raster
+void traceAllRaysExact(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight)
+{
+	traceRowsExact(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, 0, rasterHeight);
+	traceColumnsExact(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, 0, rasterWidth);
+}
+
+
+//DDA using division free slope comparisons
+//Results are deterministic across the GPU and WARP
+//job may be null, otherwise the rays are batched and the job checked as in calcR3
+int calcDDAExact(float* zArray, int zArrayLengthX, int zArrayLengthY,
+	int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
+	int rasterWidth, int rasterHeight, ViewshedJob* job)
+{
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	const array_view<const float, 2> dataViewZ(zArrayLengthY, zArrayLengthX, &zArray[0, 0]);
+	array_view<int, 2> dataViewVisible(visibleArrayY, visibleArrayX, &visibleArray[0, 0]);
+
+	dataViewVisible(currY, currX) = 1;
+
+	ULONGLONG startTicks = GetTickCount64();
+	int rayTotal = rasterWidth + rasterHeight;
+	int raysDone = 0;
+
+	int status = traceInBatches(av, job, startTicks, rasterHeight, raysDone, rayTotal, [&](int first, int count)
+	{
+		traceRowsExact(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+	});
+	if (status == VIEWSHED_OK)
+	{
+		status = traceInBatches(av, job, startTicks, rasterWidth, raysDone, rayTotal, [&](int first, int count)
+		{
+			traceColumnsExact(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+		});
+	}
+
+	dataViewVisible.synchronize();
+	return status;
+}
+
+//Exact DDA that also returns the horizon angle and the minimum visible target height of each cell
+//in the same pass, replacing a sweep of runs over target heights. Either output may be null.
+//Cells no ray reached are left at FLT_MAX.
+int calcHorizon(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int* visibleArray, float* horizonArray, float* minHeightArray)
+{
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	extent<1> eY(rasterHeight);
+	extent<1> eX(rasterWidth);
+	const array_view<const float, 2> dataViewZ(rasterHeight, rasterWidth, zArray);
+	array_view<int, 2> dataViewVisible(rasterHeight, rasterWidth, visibleArray);
+
+	std::vector<int> horizonFixed(rasterWidth * rasterHeight, HORIZON_UNSET);
+	std::vector<int> minHeightFixed(rasterWidth * rasterHeight, HORIZON_UNSET);
+	array_view<int, 2> dataViewHorizon(rasterHeight, rasterWidth, horizonFixed);
+	array_view<int, 2> dataViewMinHeight(rasterHeight, rasterWidth, minHeightFixed);
+
+	dataViewVisible(currY, currX) = 1;
 
 	parallel_for_each(av, eY, [=](index<1> idx) restrict(amp)
+	{
+		traceRayHorizon(dataViewZ, dataViewVisible, dataViewHorizon, dataViewMinHeight, currX, currY, currZ, 0, idx[0]);
+		traceRayHorizon(dataViewZ, dataViewVisible, dataViewHorizon, dataViewMinHeight, currX, currY, currZ, rasterWidth - 1, idx[0]);
+	});
+
+	parallel_for_each(av, eX, [=](index<1> idx) restrict(amp)
+	{
+		traceRayHorizon(dataViewZ, dataViewVisible, dataViewHorizon, dataViewMinHeight, currX, currY, currZ, idx[0], 0);
+		traceRayHorizon(dataViewZ, dataViewVisible, dataViewHorizon, dataViewMinHeight, currX, currY, currZ, idx[0], rasterHeight - 1);
+	});
+
+	dataViewVisible.synchronize();
+	dataViewHorizon.synchronize();
+	dataViewMinHeight.synchronize();
+
+	//the observer has nothing in front of it
+	horizonFixed[currY * rasterWidth + currX] = (int) (-1.5707963f * HORIZON_ANGLE_SCALE);
+	minHeightFixed[currY * rasterWidth + currX] = 0;
+
+	for (int i = 0; i < rasterWidth * rasterHeight; i++)
+	{
+		if (horizonArray != NULL)
+		{
+			horizonArray[i] = horizonFixed[i] == HORIZON_UNSET ? FLT_MAX : horizonFixed[i] / HORIZON_ANGLE_SCALE;
+		}
+		if (minHeightArray != NULL)
+		{
+			minHeightArray[i] = minHeightFixed[i] == HORIZON_UNSET ? FLT_MAX : minHeightFixed[i] / MIN_HEIGHT_SCALE;
+		}
+	}
+
+	return VIEWSHED_OK;
+}
+
+//R3 rays from the observer to the West and East edge cells of rows first to first + count - 1
+void traceR3Rows(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	TraceScope scope("r3 rows", count);
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
 	{
 
 		int destX;
@@ -227,12 +530,12 @@ void calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
 			if (i == 0)
 			{
 				destX = 0;
-				destY = idx[0];
+				destY = first + idx[0];
 			}
 			else
 			{
 				destX = rasterWidth;
-				destY = rasterHeight - idx[0];
+				destY = rasterHeight - (first + idx[0]);
 			}
 
 
@@ -342,9 +645,20 @@ void calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		}
 
 	});
+	if (scope.active)
+	{
+		//so the event covers the rays rather than their submission
+		av.wait();
+	}
+}
 
 
-	parallel_for_each(av, eX, [=](index<1> idx) restrict(amp)
+//R3 rays from the observer to the South and North edge cells of columns first to first + count - 1
+void traceR3Columns(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int first, int count)
+{
+	TraceScope scope("r3 columns", count);
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
 	{
 
 		int destX;
@@ -353,12 +667,12 @@ void calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		{
 			if (i == 0)
 			{
-				destX = idx[0];
+				destX = first + idx[0];
 				destY = 0;
 			}
 			else
 			{
-				destX = rasterWidth - idx[0];
+				destX = rasterWidth - (first + idx[0]);
 				destY = rasterHeight;
 			}
 			//Values for stepping through the line
@@ -467,9 +781,45 @@ void calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
 		}
 
 	});
+	if (scope.active)
+	{
+		//so the event covers the rays rather than their submission
+		av.wait();
+	}
+}
+
+
+//job may be null, otherwise rays go out in batches of JOB_RAY_BATCH and the job is checked
+//between them. A stopped job has traced job->completed of job->total ray pairs.
+int calcR3(float* zArray, int zArrayLengthX, int zArrayLengthY,
+	int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
+	int rasterWidth, int rasterHeight, ViewshedJob* job)
+{
+	accelerator device(accelerator::default_accelerator);
+	accelerator_view av = device.default_view;
 
+	const array_view<const float, 2> dataViewZ(zArrayLengthY, zArrayLengthX, &zArray[0, 0]);
+	array_view<int, 2> dataViewVisible(visibleArrayY, visibleArrayX, &visibleArray[0, 0]);
+	dataViewVisible.discard_data();
+	// Run code on the GPU
+	dataViewVisible(currX, currY) = 1;
 
+	ULONGLONG startTicks = GetTickCount64();
+	int rayTotal = zArrayLengthX + zArrayLengthY;
+	int raysDone = 0;
 
+	int status = traceInBatches(av, job, startTicks, zArrayLengthY, raysDone, rayTotal, [&](int first, int count)
+	{
+		traceR3Rows(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+	});
+	if (status != VIEWSHED_OK)
+	{
+		return status;
+	}
+	return traceInBatches(av, job, startTicks, zArrayLengthX, raysDone, rayTotal, [&](int first, int count)
+	{
+		traceR3Columns(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight, first, count);
+	});
 }
 
 
@@ -894,9 +1244,31 @@ void calcXdrawOptim(float* zArray, int zArrayLengthX, int zArrayLengthY,
 }
 
 
-void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
+//Line of sight in front of a ring cell, interpolated where the line back to the observer crosses
+//the previous ring. Of the two previous ring cells, the straight one has the same minor offset and
+//the diagonal one is a step nearer the axis; the line crosses minor / ring of the way towards the
+//diagonal. Ring 1 only has the observer in front of it.
+inline float xdrawLerp(float straightLos, float diagonalLos, int minor, int ring) restrict(amp)
+{
+	if (ring == 1)
+	{
+		return -FLT_MAX;
+	}
+
+	float weight = direct3d::abs(minor) / (float) ring;
+	if (weight >= 1.0f)
+	{
+		return diagonalLos;
+	}
+	return straightLos + (diagonalLos - straightLos) * weight;
+}
+
+
+//job may be null, otherwise it is checked every XDRAW_CHECK_RINGS rings. Rings only depend on
+//the ones inside them, so a stopped job's visibility is final out to job->completed rings.
+int calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 	int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
-	int rasterWidth, int rasterHeight, float* losArray)
+	int rasterWidth, int rasterHeight, float* losArray, ViewshedJob* job)
 {
 
 
@@ -926,8 +1298,25 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 	int maxRingY = max(rasterHeight - currY - 1, currY);
 	int maxRingX = max(rasterWidth - currX - 1, currX);
 
+	ULONGLONG startTicks = GetTickCount64();
+	int status = VIEWSHED_OK;
+
 	while (ringCounter < maxRingY)
 	{
+		TraceScope ring("xdraw ring", ringCounter);
+		if (job != NULL && (ringCounter - RING_COUNTER) % XDRAW_CHECK_RINGS == 0)
+		{
+			TraceScope wait("xdraw wait", ringCounter);
+			av.wait();
+			//ring ringCounter hasn't been dispatched yet, the ones inside it are done
+			jobProgress(job, ringCounter - 1, maxRingY - 1);
+			status = jobStatus(job, startTicks);
+			if (status != VIEWSHED_OK)
+			{
+				break;
+			}
+		}
+
 		extent<1> yExtent(northNorthEastCounter + northNorthWestCounter + southSouthEastCounter + southSouthWestCounter + 1);
 
 		//Get CPU to calculate DDA compass points then send LOSARRAY to GPU
@@ -947,17 +1336,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(y1, x1);
 				float rightLos = losArrayView(y2, x2);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerpX = (((x1 * y2) - (y1 * x2)) * (currX * interX)) - (x1 - x2) * ((currX * interY)  - (currY * interX)) /
-				//	((x1 - x2)*(currY - interY)) - ((y1 - y2) * (currX - interX));
-
-				//float lerpLOS =  (rightLos - leftLos) * fast_math::fabs(rightLos - losLerpX);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interX - currX, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -987,12 +1366,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interX - currX, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1021,12 +1395,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interX - currX, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1055,12 +1424,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interX - currX, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1103,12 +1467,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(leftLos, rightLos, interY - currY, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1138,12 +1497,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(leftLos, rightLos, interY - currY, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1173,12 +1527,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interY - currY, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1208,12 +1557,7 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 				float leftLos = losArrayView(vert1Y, vert1X);
 				float rightLos = losArrayView(vert2Y, vert2X);
 
-				float losMax = fast_math::fmaxf(leftLos, rightLos);
-				float losMin = fast_math::fminf(leftLos, rightLos);
-
-				//float losLerp = rightLos + (leftLos - rightLos) * (interX / interY);//does not work!!!l!l!!
-
-				float lerpLOS = (losMin + losMax) / 2;
+				float lerpLOS = xdrawLerp(rightLos, leftLos, interY - currY, ringCounter);
 
 				float d = fast_math::sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
 				float e = ((dataViewZ(interY, interX) - currZ) / d);
@@ -1274,37 +1618,1293 @@ void calcXdraw(float* zArray, int zArrayLengthX, int zArrayLengthY,
 	losArrayView.discard_data();
 	dataViewZ.discard_data();
 
+	if (status == VIEWSHED_OK)
+	{
+		jobProgress(job, maxRingY - 1, maxRingY - 1);
+	}
+	return status;
 }
 
 
 
-extern "C" __declspec (dllexport)
-	void _stdcall staging(float* zArray, int zArrayLengthX,
-	int zArrayLengthY, int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
-	int rasterWidth, int rasterHeight, float* losArray, int gpuType)
+//XDRAW on a cleared visibleArray with the compass lines seeded here. If mismatchCount is not null
+//DDA_EXACT is also run and the number of cells that differ from it is returned there, for checking
+//XDRAW against the exact rays on a production DEM before relying on it.
+int calcValidateXdraw(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int* visibleArray, int* mismatchCount)
 {
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
 
+	std::vector<float> losArray(rasterWidth * rasterHeight, 0.0f);
+	std::fill(visibleArray, visibleArray + rasterWidth * rasterHeight, 0);
 
-	if (gpuType == XDRAW)
+	seedXdraw(zArray, visibleArray, losArray.data(), rasterWidth, rasterHeight, currX, currY, currZ);
+	calcXdraw(zArray, rasterWidth, rasterHeight, visibleArray, rasterWidth, rasterHeight, currX, currY, currZ,
+		rasterWidth, rasterHeight, losArray.data(), NULL);
+
+	if (mismatchCount != NULL)
 	{
-		calcXdraw(zArray, zArrayLengthX, zArrayLengthY, visibleArray, visibleArrayX,
-			visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, losArray);
+		std::vector<int> reference(rasterWidth * rasterHeight, 0);
+		calcDDAExact(zArray, rasterWidth, rasterHeight, reference.data(), rasterWidth, rasterHeight, currX, currY, currZ,
+			rasterWidth, rasterHeight, NULL);
+
+		*mismatchCount = 0;
+		for (int i = 0; i < rasterWidth * rasterHeight; i++)
+		{
+			if ((visibleArray[i] != 0) != (reference[i] != 0))
+			{
+				(*mismatchCount)++;
+			}
+		}
 	}
-	else if (gpuType == DDA)
+
+	return VIEWSHED_OK;
+}
+
+
+//Pack a 0/1 raster into 32 cells per word, row major
+void packVisible(accelerator_view av, const array_view<const int, 2> &dataViewVisible, const array_view<unsigned int, 1> &dataViewBits,
+	int rasterWidth, int rasterHeight)
+{
+	int cellCount = rasterWidth * rasterHeight;
+
+	parallel_for_each(av, dataViewBits.get_extent(), [=](index<1> idx) restrict(amp)
 	{
-		calcDDA(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
-			visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight);
-	}
-	else if (gpuType == R3)
+		unsigned int word = 0;
+		for (int b = 0; b < 32; b++)
+		{
+			int cell = idx[0] * 32 + b;
+			if (cell < cellCount && dataViewVisible(cell / rasterWidth, cell % rasterWidth) != 0)
+			{
+				word |= 1u << b;
+			}
+		}
+		dataViewBits[idx] = word;
+	});
+}
+
+
+//Edge cell path ray number ray is cast to, the west and east edges first, then south and north
+inline void pathRayDest(int ray, int rasterWidth, int rasterHeight, int &destX, int &destY) restrict(amp)
+{
+	if (ray < 2 * rasterHeight)
 	{
-		calcR3(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
-			visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight);
+		destX = ray < rasterHeight ? 0 : rasterWidth - 1;
+		destY = ray % rasterHeight;
 	}
-	else if (gpuType == R2)
+	else
 	{
-		//calcR2(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
-			//visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, losArray);
+		ray -= 2 * rasterHeight;
+		destX = ray % rasterWidth;
+		destY = ray < rasterWidth ? 0 : rasterHeight - 1;
 	}
+}
+
+
+//traceRayExact that adds delta to the count of every cell it sees instead of marking it, so a
+//ray can be taken back out by tracing it again with -delta. Returns the steps before the first
+//hidden cell, the distance within which the ray's terrain casts no shadow.
+int traceRayCounted(const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewCount,
+	int currX, int currY, int currZ, int destX, int destY, int delta) restrict(amp)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+	int clearSteps = steps;
 
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
 
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double dz = (double) dataViewZ(y, x) - currZ;
+
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			atomic_fetch_add(&dataViewCount(y, x), delta);
+			highestZ = dz;
+			highestDistSq = distSq;
+		}
+		else if (clearSteps == steps)
+		{
+			clearSteps = k - 1;
+		}
+	}
+	return clearSteps;
+}
+
+
+//Move the path's rays to a new observer, retracing only those whose horizon has moved
+//
+//dataViewRays holds, per edge ray, the observer it was last traced from (x, y, z, x < 0 for
+//never) and the distance before its first hidden cell. Everything a ray hides lies behind
+//terrain at least that far out, so while the observer stays within angularTolerance times
+//that distance of where the ray was traced, its horizons have
+//turned by less than angularTolerance radians and the ray is kept. Other rays are taken back
+//out of dataViewCount and traced again from the new observer. A cell is visible while any
+//ray counts it. The observer's move is the larger of its x and y steps plus its change of
+//height, which is in metres and is divided by cellSize to count in cells like the rest.
+void updatePathRays(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewCount,
+	const array_view<int, 2> &dataViewRays, int currX, int currY, int currZ, float cellSize, float angularTolerance,
+	int rasterWidth, int rasterHeight)
+{
+	parallel_for_each(av, extent<1>(dataViewRays.get_extent()[0]), [=](index<1> idx) restrict(amp)
+	{
+		int ray = idx[0];
+		int destX;
+		int destY;
+		pathRayDest(ray, rasterWidth, rasterHeight, destX, destY);
+
+		int anchorX = dataViewRays(ray, 0);
+		int anchorY = dataViewRays(ray, 1);
+		int anchorZ = dataViewRays(ray, 2);
+
+		if (anchorX >= 0)
+		{
+			float drift = max(direct3d::abs(currX - anchorX), direct3d::abs(currY - anchorY))
+				+ direct3d::abs(currZ - anchorZ) / cellSize;
+			if (drift <= angularTolerance * dataViewRays(ray, 3))
+			{
+				return;
+			}
+			traceRayCounted(dataViewZ, dataViewCount, anchorX, anchorY, anchorZ, destX, destY, -1);
+		}
+
+		dataViewRays(ray, 0) = currX;
+		dataViewRays(ray, 1) = currY;
+		dataViewRays(ray, 2) = currZ;
+		dataViewRays(ray, 3) = traceRayCounted(dataViewZ, dataViewCount, currX, currY, currZ, destX, destY, 1);
+	});
+}
+
+
+//Viewsheds for an observer moving along a path of cells, using the exact DDA
+//The DEM is uploaded once and stays on the accelerator for the whole path, and the results
+//are accumulated there, so nothing is copied back until the path is finished.
+//A position that repeats the previous one (a stopped vehicle) reuses its rays.
+//With angularTolerance 0 every other position is traced in full. Above 0 the rays are kept
+//between positions and only those whose horizon has moved by more than angularTolerance
+//radians are retraced, see updatePathRays; cells close to a kept ray's horizon may then differ
+//from the exact viewshed. cellSize, in the units of the heights, is only used to weigh the
+//observer's changes of height against its moves across the raster.
+//outputMode is PATH_UNION or PATH_COUNT for a rasterWidth x rasterHeight int raster, or
+//PATH_PER_POSITION for pathLength packed bitmaps of (rasterWidth * rasterHeight + 31) / 32 words
+int calcPath(float* zArray, int rasterWidth, int rasterHeight, float cellSize, int* pathX, int* pathY, int* pathZ,
+	int pathLength, float angularTolerance, int* outputArray, int outputMode)
+{
+	if (outputMode != PATH_UNION && outputMode != PATH_COUNT && outputMode != PATH_PER_POSITION)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	if (angularTolerance < 0 || cellSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	for (int p = 0; p < pathLength; p++)
+	{
+		if (pathX[p] < 0 || pathX[p] >= rasterWidth || pathY[p] < 0 || pathY[p] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	int wordsPerRaster = (rasterWidth * rasterHeight + 31) / 32;
+
+	//Resident copies, live for the whole path
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av);
+	array<int, 2> visibleResident(rasterHeight, rasterWidth, av);
+	array<int, 2> totalResident(rasterHeight, rasterWidth, av);
+	array<unsigned int, 1> bitsResident(wordsPerRaster, av);
+
+	//Kept rays, only used with a tolerance
+	bool incremental = angularTolerance > 0;
+	int rayCount = incremental ? 2 * (rasterWidth + rasterHeight) : 1;
+	array<int, 2> countResident(incremental ? rasterHeight : 1, incremental ? rasterWidth : 1, av);
+	array<int, 2> raysResident(rayCount, 4, av);
+
+	const array_view<const float, 2> dataViewZ(zResident);
+	array_view<int, 2> dataViewVisible(visibleResident);
+	array_view<int, 2> dataViewTotal(totalResident);
+	array_view<unsigned int, 1> dataViewBits(bitsResident);
+	array_view<int, 2> dataViewCount(countResident);
+	array_view<int, 2> dataViewRays(raysResident);
+
+	parallel_for_each(av, dataViewTotal.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewTotal[idx] = 0;
+	});
+	parallel_for_each(av, dataViewCount.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewCount[idx] = 0;
+	});
+	parallel_for_each(av, dataViewRays.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewRays[idx] = -1;
+	});
+
+	for (int p = 0; p < pathLength; p++)
+	{
+		int currX = pathX[p];
+		int currY = pathY[p];
+		int currZ = pathZ[p];
+
+		bool repeated = p > 0 && currX == pathX[p - 1] && currY == pathY[p - 1] && currZ == pathZ[p - 1];
+
+		if (!repeated && incremental)
+		{
+			updatePathRays(av, dataViewZ, dataViewCount, dataViewRays, currX, currY, currZ, cellSize, angularTolerance,
+				rasterWidth, rasterHeight);
+
+			parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+			{
+				dataViewVisible[idx] = (dataViewCount[idx] > 0 || (idx[0] == currY && idx[1] == currX)) ? 1 : 0;
+			});
+		}
+		else if (!repeated)
+		{
+			//clear last position's rays, the observer is always visible
+			parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+			{
+				dataViewVisible[idx] = (idx[0] == currY && idx[1] == currX) ? 1 : 0;
+			});
+
+			traceAllRaysExact(av, dataViewZ, dataViewVisible, currX, currY, currZ, rasterWidth, rasterHeight);
+		}
+
+		if (outputMode == PATH_PER_POSITION)
+		{
+			packVisible(av, dataViewVisible, dataViewBits, rasterWidth, rasterHeight);
+			copy(bitsResident, (unsigned int*) outputArray + p * wordsPerRaster);
+		}
+		else if (outputMode == PATH_COUNT)
+		{
+			parallel_for_each(av, dataViewTotal.get_extent(), [=](index<2> idx) restrict(amp)
+			{
+				dataViewTotal[idx] += dataViewVisible[idx];
+			});
+		}
+		else
+		{
+			parallel_for_each(av, dataViewTotal.get_extent(), [=](index<2> idx) restrict(amp)
+			{
+				dataViewTotal[idx] |= dataViewVisible[idx];
+			});
+		}
+	}
+
+	if (outputMode != PATH_PER_POSITION)
+	{
+		copy(totalResident, outputArray);
+	}
+	return VIEWSHED_OK;
+}
+
+
+//Exact DDA viewshed of each observer in turn, handed to onViewshed as a packed bitmap of
+//(rasterWidth * rasterHeight + 31) / 32 words. The DEM stays resident between observers and
+//the bitmap is only valid for the duration of the callback.
+int calcEachViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, const std::function<void(int, const unsigned int*)> &onViewshed)
+{
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	int wordsPerRaster = (rasterWidth * rasterHeight + 31) / 32;
+	std::vector<unsigned int> bits(wordsPerRaster);
+
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av);
+	array<int, 2> visibleResident(rasterHeight, rasterWidth, av);
+	array<unsigned int, 1> bitsResident(wordsPerRaster, av);
+
+	const array_view<const float, 2> dataViewZ(zResident);
+	array_view<int, 2> dataViewVisible(visibleResident);
+	array_view<unsigned int, 1> dataViewBits(bitsResident);
+
+	for (int i = 0; i < observerCount; i++)
+	{
+		TraceScope trace("observer", i);
+		int currX = observerX[i];
+		int currY = observerY[i];
+
+		parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+		{
+			dataViewVisible[idx] = (idx[0] == currY && idx[1] == currX) ? 1 : 0;
+		});
+
+		traceAllRaysExact(av, dataViewZ, dataViewVisible, currX, currY, observerZ[i], rasterWidth, rasterHeight);
+		packVisible(av, dataViewVisible, dataViewBits, rasterWidth, rasterHeight);
+		copy(bitsResident, bits.data());
+
+		onViewshed(i, bits.data());
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+//Offset from the observer of cell i of ring r, going clockwise from the corner (-r, -r)
+inline void ringCell(int r, int i, int &dx, int &dy) restrict(amp)
+{
+	if (i < 2 * r)
+	{
+		dx = -r + i;
+		dy = -r;
+	}
+	else if (i < 4 * r)
+	{
+		dx = r;
+		dy = -r + (i - 2 * r);
+	}
+	else if (i < 6 * r)
+	{
+		dx = r - (i - 4 * r);
+		dy = r;
+	}
+	else
+	{
+		dx = -r;
+		dy = r - (i - 6 * r);
+	}
+}
+
+
+//Inverse of ringCell
+inline int ringIndex(int r, int dx, int dy) restrict(amp)
+{
+	if (dy == -r && dx < r)
+	{
+		return dx + r;
+	}
+	if (dx == r && dy < r)
+	{
+		return 3 * r + dy;
+	}
+	if (dy == r && dx > -r)
+	{
+		return 5 * r - dx;
+	}
+	return 7 * r - dy;
+}
+
+
+//XDRAW for many observers at once
+//
+//Each dispatch advances ring r of a whole batch of batchSize observers, one thread
+//per (observer, ring cell), so even the first rings fill the device. A cell's line of sight is
+//interpolated from the two ring r - 1 cells either side of the line back to its observer, and
+//it is visible if its own slope is at least that. Only the previous ring is ever read, so the
+//line of sight lives in two ring sized buffers, each observer's row a separate slice of them.
+//visibleBits receives observerCount packed bitmaps of (rasterWidth * rasterHeight + 31) / 32
+//words, as calcPath's PATH_PER_POSITION. Every observer in a batch keeps a packed raster on the
+//accelerator, so batchSize is cut to fit in 1 / XDRAW_BATCH_MEMORY_SHARE of its dedicated memory.
+int calcXdrawBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int batchSize, unsigned int* visibleBits)
+{
+	if (batchSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	accelerator device(accelerator::default_accelerator);
+	accelerator_view av = device.default_view;
+
+	int wordsPerRaster = (rasterWidth * rasterHeight + 31) / 32;
+	int ringLimit = max(rasterWidth, rasterHeight);
+
+	//dedicated memory is in KB, 0 where the accelerator shares system memory
+	size_t memoryBudget = device.get_dedicated_memory() * 1024 / XDRAW_BATCH_MEMORY_SHARE;
+	if (memoryBudget > 0)
+	{
+		size_t rasterBytes = (size_t) rasterWidth * rasterHeight * sizeof(float);
+		size_t observerBytes = (size_t) wordsPerRaster * sizeof(unsigned int) + 2 * 8 * (size_t) ringLimit * sizeof(float);
+		size_t fit = memoryBudget > rasterBytes ? (memoryBudget - rasterBytes) / observerBytes : 0;
+		batchSize = (int) min((size_t) batchSize, max(fit, (size_t) 1));
+	}
+
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av);
+	array<float, 2> losEvenResident(batchSize, 8 * ringLimit, av);
+	array<float, 2> losOddResident(batchSize, 8 * ringLimit, av);
+	array<unsigned int, 2> bitsResident(batchSize, wordsPerRaster, av);
+
+	const array_view<const float, 2> dataViewZ(zResident);
+	array_view<float, 2> losEven(losEvenResident);
+	array_view<float, 2> losOdd(losOddResident);
+	array_view<unsigned int, 2> dataViewBits(bitsResident);
+
+	std::vector<int> batchX(batchSize);
+	std::vector<int> batchY(batchSize);
+	std::vector<int> batchZ(batchSize);
+
+	for (int first = 0; first < observerCount; first += batchSize)
+	{
+		int batch = min(batchSize, observerCount - first);
+		int maxRing = 0;
+
+		for (int b = 0; b < batch; b++)
+		{
+			batchX[b] = observerX[first + b];
+			batchY[b] = observerY[first + b];
+			batchZ[b] = observerZ[first + b];
+			maxRing = max(maxRing, max(max(batchX[b], rasterWidth - 1 - batchX[b]), max(batchY[b], rasterHeight - 1 - batchY[b])));
+		}
+
+		const array_view<const int, 1> dataViewX(batch, batchX);
+		const array_view<const int, 1> dataViewY(batch, batchY);
+		const array_view<const int, 1> dataViewObsZ(batch, batchZ);
+
+		//each observer sees itself
+		parallel_for_each(av, extent<2>(batch, wordsPerRaster), [=](index<2> idx) restrict(amp)
+		{
+			int cell = dataViewY(idx[0]) * rasterWidth + dataViewX(idx[0]);
+			dataViewBits[idx] = cell / 32 == idx[1] ? 1u << (cell % 32) : 0u;
+		});
+
+		for (int r = 1; r <= maxRing; r++)
+		{
+			array_view<float, 2> losPrev = r % 2 == 0 ? losOdd : losEven;
+			array_view<float, 2> losCur = r % 2 == 0 ? losEven : losOdd;
+
+			parallel_for_each(av, extent<2>(batch, 8 * r), [=](index<2> idx) restrict(amp)
+			{
+				int b = idx[0];
+				int currX = dataViewX(b);
+				int currY = dataViewY(b);
+
+				int dx;
+				int dy;
+				ringCell(r, idx[1], dx, dy);
+				int x = currX + dx;
+				int y = currY + dy;
+				if (x < 0 || x >= rasterWidth || y < 0 || y >= rasterHeight)
+				{
+					//still read by the next ring's edge cells, with a weight of 0
+					losCur(b, idx[1]) = -FLT_MAX;
+					return;
+				}
+
+				float slope = (dataViewZ(y, x) - dataViewObsZ(b)) * fast_math::rsqrt((float) (dx * dx + dy * dy));
+				float los = slope;
+
+				if (r > 1)
+				{
+					//where the line back to the observer crosses ring r - 1
+					int major = direct3d::abs(dx) >= direct3d::abs(dy) ? dx : dy;
+					int minor = direct3d::abs(dx) >= direct3d::abs(dy) ? dy : dx;
+					float cross = minor * (r - 1) / (float) r;
+					int low = (int) fast_math::floor(cross);
+					int high = min(low + 1, r - 1);
+					float weight = cross - low;
+					int stepBack = major > 0 ? major - 1 : major + 1;
+
+					int lowIndex = direct3d::abs(dx) >= direct3d::abs(dy) ? ringIndex(r - 1, stepBack, low) : ringIndex(r - 1, low, stepBack);
+					int highIndex = direct3d::abs(dx) >= direct3d::abs(dy) ? ringIndex(r - 1, stepBack, high) : ringIndex(r - 1, high, stepBack);
+
+					float prevLos = losPrev(b, lowIndex) * (1.0f - weight) + losPrev(b, highIndex) * weight;
+					los = fast_math::fmaxf(slope, prevLos);
+					if (slope < prevLos)
+					{
+						losCur(b, idx[1]) = los;
+						return;
+					}
+				}
+
+				losCur(b, idx[1]) = los;
+				int cell = y * rasterWidth + x;
+				atomic_fetch_or(&dataViewBits(b, cell / 32), 1u << (cell % 32));
+			});
+		}
+
+		copy(bitsResident.section(0, 0, batch, wordsPerRaster), visibleBits + (size_t) first * wordsPerRaster);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+//Counter based random numbers: a stateless hash of (seed, realisation, x, y)
+//so any thread can regenerate any cell's error without storing a field
+inline unsigned int mixBits(unsigned int v) restrict(cpu, amp)
+{
+	v ^= v >> 16;
+	v *= 0x7feb352du;
+	v ^= v >> 15;
+	v *= 0x846ca68bu;
+	v ^= v >> 16;
+	return v;
+}
+
+
+//Roughly standard normal value for a lattice node, sum of four uniforms
+inline float latticeNormal(unsigned int seed, int realisation, int x, int y) restrict(cpu, amp)
+{
+	unsigned int h = mixBits(seed ^ mixBits((unsigned int) realisation ^ mixBits((unsigned int) x ^ mixBits((unsigned int) y))));
+	float sum = 0.0f;
+	for (int k = 0; k < 4; k++)
+	{
+		h = mixBits(h + 0x9e3779b9u);
+		sum += (h >> 8) * (1.0f / 16777216.0f);
+	}
+	//four uniforms have mean 2 and variance 1/3
+	return (sum - 2.0f) * 1.7320508f;
+}
+
+
+//Spatially correlated DEM error at a cell: normals on a lattice correlationLength cells apart,
+//bilinearly blended and rescaled so every cell has standard deviation errorSigma
+float demError(unsigned int seed, int realisation, int x, int y, float errorSigma, int correlationLength) restrict(amp)
+{
+	int lx = x / correlationLength;
+	int ly = y / correlationLength;
+	float fx = (float) (x - lx * correlationLength) / correlationLength;
+	float fy = (float) (y - ly * correlationLength) / correlationLength;
+
+	float w00 = (1 - fx) * (1 - fy);
+	float w10 = fx * (1 - fy);
+	float w01 = (1 - fx) * fy;
+	float w11 = fx * fy;
+
+	float blend = w00 * latticeNormal(seed, realisation, lx, ly) + w10 * latticeNormal(seed, realisation, lx + 1, ly)
+		+ w01 * latticeNormal(seed, realisation, lx, ly + 1) + w11 * latticeNormal(seed, realisation, lx + 1, ly + 1);
+
+	return errorSigma * blend * fast_math::rsqrt(w00 * w00 + w10 * w10 + w01 * w01 + w11 * w11);
+}
+
+
+//Exact DDA ray through one error realisation, setting the realisation's bit in each visible cell
+void traceRayPerturbed(const array_view<const float, 2> &dataViewZ, const array_view<unsigned int, 2> &dataViewMask,
+	int currX, int currY, float obsZ, int destX, int destY, unsigned int seed, int realisation, int bit,
+	float errorSigma, int correlationLength) restrict(amp)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		float z = dataViewZ(y, x) + demError(seed, realisation, x, y, errorSigma, correlationLength);
+		double dz = (double) z - obsZ;
+
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			atomic_fetch_or(&dataViewMask(y, x), 1u << bit);
+			highestZ = dz;
+			highestDistSq = distSq;
+		}
+	}
+}
+
+
+//Probability that each cell is visible from (currX, currY) when the DEM carries spatially
+//correlated N(0, errorSigma) error with the given correlation length in cells.
+//Each realisation's error is regenerated inside the kernel from the seed, so no perturbed DEM
+//is ever stored, and REALISATION_BATCH realisations are traced per dispatch.
+//currZ is the observer's absolute height as for staging, and moves up and down with the error
+//of the ground beneath the observer.
+int calcProbabilistic(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int realisations, float errorSigma, int correlationLength, unsigned int seed, float* probabilityArray)
+{
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight || realisations <= 0 || correlationLength <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	int rayCount = 2 * (rasterWidth + rasterHeight);
+
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av);
+	array<unsigned int, 2> maskResident(rasterHeight, rasterWidth, av);
+	array<int, 2> countResident(rasterHeight, rasterWidth, av);
+
+	const array_view<const float, 2> dataViewZ(zResident);
+	array_view<unsigned int, 2> dataViewMask(maskResident);
+	array_view<int, 2> dataViewCount(countResident);
+
+	parallel_for_each(av, dataViewCount.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewMask[idx] = 0;
+		dataViewCount[idx] = 0;
+	});
+
+	for (int first = 0; first < realisations; first += REALISATION_BATCH)
+	{
+		int batch = min(REALISATION_BATCH, realisations - first);
+
+		//one thread per realisation and edge cell
+		parallel_for_each(av, extent<2>(batch, rayCount), [=](index<2> idx) restrict(amp)
+		{
+			int realisation = first + idx[0];
+			int ray = idx[1];
+
+			int destX;
+			int destY;
+			if (ray < rasterHeight)
+			{
+				destX = 0;
+				destY = ray;
+			}
+			else if (ray < 2 * rasterHeight)
+			{
+				destX = rasterWidth - 1;
+				destY = ray - rasterHeight;
+			}
+			else if (ray < 2 * rasterHeight + rasterWidth)
+			{
+				destX = ray - 2 * rasterHeight;
+				destY = 0;
+			}
+			else
+			{
+				destX = ray - 2 * rasterHeight - rasterWidth;
+				destY = rasterHeight - 1;
+			}
+
+			float obsZ = currZ + demError(seed, realisation, currX, currY, errorSigma, correlationLength);
+
+			traceRayPerturbed(dataViewZ, dataViewMask, currX, currY, obsZ, destX, destY, seed, realisation, idx[0],
+				errorSigma, correlationLength);
+		});
+
+		//fold this batch's bits into the counts
+		parallel_for_each(av, dataViewCount.get_extent(), [=](index<2> idx) restrict(amp)
+		{
+			dataViewCount[idx] += direct3d::countbits(dataViewMask[idx]);
+			dataViewMask[idx] = 0;
+		});
+	}
+
+	std::vector<int> counts(rasterWidth * rasterHeight);
+	copy(countResident, counts.data());
+
+	for (int i = 0; i < rasterWidth * rasterHeight; i++)
+	{
+		probabilityArray[i] = (float) counts[i] / realisations;
+	}
+	probabilityArray[currY * rasterWidth + currX] = 1.0f;
+
+	return VIEWSHED_OK;
+}
+
+
+//Max preserving pyramid of the DEM, level l cell (x, y) holds the highest of the 2^l x 2^l full
+//resolution cells it covers. levelInfo holds offset, width and height of each level in pyramid.
+void buildMaxPyramid(const float* zArray, int rasterWidth, int rasterHeight, int levelCount,
+	std::vector<float> &pyramid, std::vector<int> &levelInfo)
+{
+	pyramid.assign(zArray, zArray + rasterWidth * rasterHeight);
+	levelInfo.assign(3 * levelCount, 0);
+	levelInfo[1] = rasterWidth;
+	levelInfo[2] = rasterHeight;
+
+	for (int l = 1; l < levelCount; l++)
+	{
+		int prevOffset = levelInfo[3 * (l - 1)];
+		int prevWidth = levelInfo[3 * (l - 1) + 1];
+		int prevHeight = levelInfo[3 * (l - 1) + 2];
+		int width = (prevWidth + 1) / 2;
+		int height = (prevHeight + 1) / 2;
+
+		levelInfo[3 * l] = (int) pyramid.size();
+		levelInfo[3 * l + 1] = width;
+		levelInfo[3 * l + 2] = height;
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				float highest = -FLT_MAX;
+				for (int k = 0; k < 4; k++)
+				{
+					int px = 2 * x + (k & 1);
+					int py = 2 * y + (k >> 1);
+					if (px < prevWidth && py < prevHeight)
+					{
+						highest = max(highest, pyramid[prevOffset + py * prevWidth + px]);
+					}
+				}
+				pyramid.push_back(highest);
+			}
+		}
+	}
+}
+
+
+//Approximate viewshed that samples coarser DEM levels as distance grows
+//
+//A ray sample at distance t reads the pyramid level whose blocks subtend no more than
+//angularTolerance radians, 2^l <= angularTolerance * t, and the ray steps one block at a time,
+//so samples per ray grow with log(distance) / angularTolerance rather than distance.
+//Rays are cast angularTolerance apart (at most one per edge cell) and store the horizon in
+//front of each sample. Every cell is then tested at full resolution against the horizon of
+//its nearest ray at its distance. Coarse blocks hold the highest cell they cover, so errors
+//lean towards reporting cells hidden.
+//A block is aligned to the pyramid rather than centred on its sample, so it can reach up to
+//its diagonal past the sample. A cell is only tested against samples whose blocks end short
+//of its distance, so it never counts towards its own horizon.
+//If mismatchCount is not null DDA_EXACT is also run and the number of cells that differ from
+//it is returned there, for judging a tolerance.
+int calcLevelOfDetail(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	float angularTolerance, int* visibleArray, int* mismatchCount)
+{
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight || angularTolerance <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	accelerator device(accelerator::default_accelerator);
+	accelerator_view av = device.default_view;
+
+	int levelCount = 1;
+	while (levelCount < LOD_MAX_LEVELS && (1 << levelCount) < max(rasterWidth, rasterHeight))
+	{
+		levelCount++;
+	}
+
+	std::vector<float> pyramid;
+	std::vector<int> levelInfo;
+	buildMaxPyramid(zArray, rasterWidth, rasterHeight, levelCount, pyramid, levelInfo);
+
+	//Sample schedule along a ray, the same for every direction
+	std::vector<float> sampleDist;
+	std::vector<int> sampleLevel;
+	std::vector<float> sampleReach;
+	float maxDist = sqrt((float) (rasterWidth * rasterWidth + rasterHeight * rasterHeight));
+	for (float t = 1.0f; t <= maxDist;)
+	{
+		int level = 0;
+		while (level + 1 < levelCount && (1 << (level + 1)) <= angularTolerance * t)
+		{
+			level++;
+		}
+		sampleDist.push_back(t);
+		sampleLevel.push_back(level);
+		//furthest cell centre of the block: the sample's cell is within half a diagonal of t,
+		//the rest of the block within (2^l - 1) diagonals of that cell
+		sampleReach.push_back(t + 0.75f + 1.5f * ((1 << level) - 1));
+		t += (float) (1 << level);
+	}
+
+	int sampleCount = (int) sampleDist.size();
+	int rayCount = min(2 * (rasterWidth + rasterHeight), (int) ceil(6.2831853f / angularTolerance));
+
+	const array_view<const float, 1> dataViewPyramid((int) pyramid.size(), pyramid);
+	const array_view<const int, 1> dataViewLevelInfo((int) levelInfo.size(), levelInfo);
+	const array_view<const float, 1> dataViewDist(sampleCount, sampleDist);
+	const array_view<const int, 1> dataViewLevel(sampleCount, sampleLevel);
+	const array_view<const float, 1> dataViewReach(sampleCount, sampleReach);
+	const array_view<const float, 2> dataViewZ(rasterHeight, rasterWidth, zArray);
+	array_view<int, 2> dataViewVisible(rasterHeight, rasterWidth, visibleArray);
+	dataViewVisible.discard_data();
+
+	//column i is the horizon over samples 0 to i - 1, the last column over the whole ray
+	array<float, 2> horizonResident(rayCount, sampleCount + 1, av);
+	array_view<float, 2> dataViewHorizon(horizonResident);
+
+	//Horizon in front of every sample of every ray
+	parallel_for_each(av, extent<1>(rayCount), [=](index<1> idx) restrict(amp)
+	{
+		float theta = 6.2831853f * idx[0] / rayCount;
+		float dirX = fast_math::cos(theta);
+		float dirY = fast_math::sin(theta);
+
+		float highest = -FLT_MAX;
+		bool inside = true;
+
+		for (int i = 0; i < sampleCount; i++)
+		{
+			dataViewHorizon(idx[0], i) = highest;
+
+			float t = dataViewDist(i);
+			int x = (int) fast_math::floor(currX + t * dirX + 0.5f);
+			int y = (int) fast_math::floor(currY + t * dirY + 0.5f);
+			inside = inside && x >= 0 && x < rasterWidth && y >= 0 && y < rasterHeight;
+
+			//past the edge the horizon just carries on to fill the row
+			if (inside)
+			{
+				int level = dataViewLevel(i);
+				float z = dataViewPyramid(dataViewLevelInfo(3 * level) + (y >> level) * dataViewLevelInfo(3 * level + 1) + (x >> level));
+				highest = fast_math::fmaxf(highest, (z - currZ) / t);
+			}
+		}
+		dataViewHorizon(idx[0], sampleCount) = highest;
+	});
+
+	//Each cell against the horizon of the nearest ray, just before its distance
+	parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		int dx = idx[1] - currX;
+		int dy = idx[0] - currY;
+		if (dx == 0 && dy == 0)
+		{
+			dataViewVisible[idx] = 1;
+			return;
+		}
+
+		float dist = fast_math::sqrt((float) (dx * dx + dy * dy));
+		float theta = fast_math::atan2((float) dy, (float) dx);
+		if (theta < 0)
+		{
+			theta += 6.2831853f;
+		}
+		int ray = (int) fast_math::floor(theta / 6.2831853f * rayCount + 0.5f) % rayCount;
+
+		//number of samples whose blocks end short of the cell, the reach grows along the ray
+		int lo = 0;
+		int hi = sampleCount;
+		while (lo < hi)
+		{
+			int mid = (lo + hi + 1) / 2;
+			if (dataViewReach(mid - 1) < dist)
+			{
+				lo = mid;
+			}
+			else
+			{
+				hi = mid - 1;
+			}
+		}
+
+		dataViewVisible[idx] = (dataViewZ[idx] - currZ) / dist >= dataViewHorizon(ray, lo) ? 1 : 0;
+	});
+
+	dataViewVisible.synchronize();
+
+	if (mismatchCount != NULL)
+	{
+		std::vector<int> reference(rasterWidth * rasterHeight, 0);
+		calcDDAExact(zArray, rasterWidth, rasterHeight, reference.data(), rasterWidth, rasterHeight, currX, currY, currZ,
+			rasterWidth, rasterHeight, NULL);
+
+		*mismatchCount = 0;
+		for (int i = 0; i < rasterWidth * rasterHeight; i++)
+		{
+			if ((visibleArray[i] != 0) != (reference[i] != 0))
+			{
+				(*mismatchCount)++;
+			}
+		}
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+//Called as progressive results land with the rectangle of visibleArray just written, tilesDone
+//is 0 for the coarse preview, which covers the whole raster
+typedef void (_stdcall *ProgressCallback)(int tilesDone, int tileCount, int originX, int originY, int width, int height);
+
+
+//Steps firstStep to lastStep of path rays first to first + count - 1, see pathRayDest. Each
+//ray's stepper position and horizon are kept in dataViewStepper (x, y, remainderX, remainderY)
+//and dataViewHorizon (height, squared distance) so the next band carries on from there.
+//Step k of a ray lies exactly k cells out along its longer axis, so once every ray has run
+//to lastStep all cells within lastStep cells of the observer (Chebyshev) are final.
+void traceRayBand(accelerator_view av, const array_view<const float, 2> &dataViewZ, const array_view<int, 2> &dataViewVisible,
+	const array_view<int, 2> &dataViewStepper, const array_view<double, 2> &dataViewHorizon,
+	int currX, int currY, int currZ, int rasterWidth, int rasterHeight, int firstStep, int lastStep, int first, int count)
+{
+	TraceScope scope("ray band", count);
+	parallel_for_each(av, extent<1>(count), [=](index<1> idx) restrict(amp)
+	{
+		int ray = first + idx[0];
+		int destX;
+		int destY;
+		pathRayDest(ray, rasterWidth, rasterHeight, destX, destY);
+
+		int dx = destX - currX;
+		int dy = destY - currY;
+		int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+		if (steps < firstStep)
+		{
+			return;
+		}
+
+		RayStepper stepper(dx, dy, steps);
+		double highestZ = 0.0;
+		double highestDistSq = 0.0;
+		if (firstStep > 1)
+		{
+			stepper.x = dataViewStepper(ray, 0);
+			stepper.y = dataViewStepper(ray, 1);
+			stepper.remainderX = dataViewStepper(ray, 2);
+			stepper.remainderY = dataViewStepper(ray, 3);
+			highestZ = dataViewHorizon(ray, 0);
+			highestDistSq = dataViewHorizon(ray, 1);
+		}
+
+		int endStep = min(lastStep, steps);
+		for (int k = firstStep; k <= endStep; k++)
+		{
+			stepper.next();
+			int x = currX + stepper.x;
+			int y = currY + stepper.y;
+
+			double distSq = cellDistSq(x - currX, y - currY);
+			double dz = (double) dataViewZ(y, x) - currZ;
+
+			if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+			{
+				dataViewVisible(y, x) = 1;
+				highestZ = dz;
+				highestDistSq = distSq;
+			}
+		}
+
+		dataViewStepper(ray, 0) = stepper.x;
+		dataViewStepper(ray, 1) = stepper.y;
+		dataViewStepper(ray, 2) = stepper.remainderX;
+		dataViewStepper(ray, 3) = stepper.remainderY;
+		dataViewHorizon(ray, 0) = highestZ;
+		dataViewHorizon(ray, 1) = highestDistSq;
+	});
+}
+
+
+//Progressive viewshed: a coarse preview at once, then exact tiles nearest the observer first
+//
+//The first pass runs on level coarseLevel of the max pyramid (blocks of 2^coarseLevel cells),
+//or on the level that brings the longer side under PROGRESSIVE_PREVIEW_SIZE if coarseLevel is
+//negative, and fills visibleArray block by block. Then the full resolution DDA_EXACT edge rays
+//are traced outward in bands of tileSize steps, and after each band every tile now wholly
+//within reach of the rays is copied over, so the tiles come nearest the observer (Chebyshev)
+//first and end up exactly as DDA_EXACT. The work is that of one DDA_EXACT run, plus a copy of
+//each tile; no dispatch does more than tileSize steps of each ray, and with a job at most
+//JOB_RAY_BATCH rays.
+//After every tile the finished tile count is written to progressCursor and onProgress is
+//called with the tile just written, either may be null. Tiles are only written whole, so a
+//reader that sees the cursor move can draw every tile up to it. tileOrder, if not null, gets
+//the row major index of each tile in the order they are done (ceil(width / tileSize) *
+//ceil(height / tileSize) of them), filled in before the cursor first moves.
+//job may be null, otherwise it is checked between ray batches and counts ray bands as they finish.
+int calcProgressive(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int coarseLevel, int tileSize, int* visibleArray, volatile LONG* progressCursor, int* tileOrder,
+	ProgressCallback onProgress, ViewshedJob* job)
+{
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight || tileSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	if (coarseLevel < 0)
+	{
+		coarseLevel = 0;
+		while (coarseLevel + 1 < LOD_MAX_LEVELS && (max(rasterWidth, rasterHeight) >> coarseLevel) > PROGRESSIVE_PREVIEW_SIZE)
+		{
+			coarseLevel++;
+		}
+	}
+	coarseLevel = min(coarseLevel, LOD_MAX_LEVELS - 1);
+
+	int tilesX = (rasterWidth + tileSize - 1) / tileSize;
+	int tilesY = (rasterHeight + tileSize - 1) / tileSize;
+	int tileCount = tilesX * tilesY;
+
+	//Coarse preview
+	std::vector<float> pyramid;
+	std::vector<int> levelInfo;
+	buildMaxPyramid(zArray, rasterWidth, rasterHeight, coarseLevel + 1, pyramid, levelInfo);
+
+	int coarseWidth = levelInfo[3 * coarseLevel + 1];
+	int coarseHeight = levelInfo[3 * coarseLevel + 2];
+	std::vector<int> coarseVisible(coarseWidth * coarseHeight);
+	{
+		const array_view<const float, 2> dataViewCoarseZ(coarseHeight, coarseWidth, &pyramid[levelInfo[3 * coarseLevel]]);
+		array_view<int, 2> dataViewCoarse(coarseHeight, coarseWidth, coarseVisible);
+		dataViewCoarse.discard_data();
+
+		int coarseX = currX >> coarseLevel;
+		int coarseY = currY >> coarseLevel;
+
+		parallel_for_each(av, dataViewCoarse.get_extent(), [=](index<2> idx) restrict(amp)
+		{
+			dataViewCoarse[idx] = (idx[0] == coarseY && idx[1] == coarseX) ? 1 : 0;
+		});
+		traceAllRaysExact(av, dataViewCoarseZ, dataViewCoarse, coarseX, coarseY, currZ, coarseWidth, coarseHeight);
+		dataViewCoarse.synchronize();
+	}
+
+	for (int y = 0; y < rasterHeight; y++)
+	{
+		for (int x = 0; x < rasterWidth; x++)
+		{
+			visibleArray[y * rasterWidth + x] = coarseVisible[(y >> coarseLevel) * coarseWidth + (x >> coarseLevel)];
+		}
+	}
+
+	//Tiles by the Chebyshev distance of their farthest cell from the observer, the ray step
+	//after which they are final
+	std::vector<std::pair<int, int> > tileReach(tileCount);
+	for (int t = 0; t < tileCount; t++)
+	{
+		int originX = (t % tilesX) * tileSize;
+		int originY = (t / tilesX) * tileSize;
+		int farX = max(abs(originX - currX), abs(min(originX + tileSize, rasterWidth) - 1 - currX));
+		int farY = max(abs(originY - currY), abs(min(originY + tileSize, rasterHeight) - 1 - currY));
+		tileReach[t] = std::make_pair(max(farX, farY), t);
+	}
+	std::sort(tileReach.begin(), tileReach.end());
+
+	if (tileOrder != NULL)
+	{
+		for (int t = 0; t < tileCount; t++)
+		{
+			tileOrder[t] = tileReach[t].second;
+		}
+	}
+	if (progressCursor != NULL)
+	{
+		InterlockedExchange(progressCursor, 0);
+	}
+	if (onProgress != NULL)
+	{
+		onProgress(0, tileCount, 0, 0, rasterWidth, rasterHeight);
+	}
+
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av);
+	array<int, 2> visibleResident(rasterHeight, rasterWidth, av);
+	const array_view<const float, 2> dataViewZ(zResident);
+	array_view<int, 2> dataViewVisible(visibleResident);
+
+	parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewVisible[idx] = (idx[0] == currY && idx[1] == currX) ? 1 : 0;
+	});
+
+	int rayCount = 2 * (rasterWidth + rasterHeight);
+	array<int, 2> stepperResident(rayCount, 4, av);
+	array<double, 2> horizonResident(rayCount, 2, av);
+	array_view<int, 2> dataViewStepper(stepperResident);
+	array_view<double, 2> dataViewHorizon(horizonResident);
+
+	int reach = max(max(currX, rasterWidth - 1 - currX), max(currY, rasterHeight - 1 - currY));
+	int bandCount = (reach + tileSize - 1) / tileSize;
+	int rayTotal = rayCount * bandCount;
+	int raysDone = 0;
+
+	std::vector<int> tileVisible(tileSize * tileSize);
+	ULONGLONG startTicks = GetTickCount64();
+	int t = 0;
+
+	for (int firstStep = 1; t < tileCount; firstStep += tileSize)
+	{
+		int lastStep = firstStep + tileSize - 1;
+		if (firstStep <= reach)
+		{
+			int status = traceInBatches(av, job, startTicks, rayCount, raysDone, rayTotal, [&](int first, int count)
+			{
+				traceRayBand(av, dataViewZ, dataViewVisible, dataViewStepper, dataViewHorizon, currX, currY, currZ,
+					rasterWidth, rasterHeight, firstStep, lastStep, first, count);
+			});
+			if (status != VIEWSHED_OK)
+			{
+				return status;
+			}
+		}
+
+		for (; t < tileCount && tileReach[t].first <= lastStep; t++)
+		{
+			int originX = (tileReach[t].second % tilesX) * tileSize;
+			int originY = (tileReach[t].second / tilesX) * tileSize;
+			int width = min(tileSize, rasterWidth - originX);
+			int height = min(tileSize, rasterHeight - originY);
+
+			array_view<int, 2> dataViewTile(height, width, tileVisible);
+			dataViewTile.discard_data();
+
+			parallel_for_each(av, dataViewTile.get_extent(), [=](index<2> idx) restrict(amp)
+			{
+				dataViewTile[idx] = dataViewVisible(originY + idx[0], originX + idx[1]);
+			});
+			dataViewTile.synchronize();
+
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					visibleArray[(originY + y) * rasterWidth + originX + x] = tileVisible[y * width + x];
+				}
+			}
+
+			if (progressCursor != NULL)
+			{
+				InterlockedExchange(progressCursor, t + 1);
+			}
+			if (onProgress != NULL)
+			{
+				onProgress(t + 1, tileCount, originX, originY, width, height);
+			}
+		}
+	}
+
+	jobProgress(job, rayTotal, rayTotal);
+
+	return VIEWSHED_OK;
+}
+
+
+//staging with an optional job for cancellation and time budgets, see ViewshedJob.
+//XDRAW checks the job between rings, DDA, DDA_EXACT and R3 between ray batches through
+//traceInBatches. R2 is stubbed out and does no work.
+//Returns VIEWSHED_CANCELLED or VIEWSHED_TIMED_OUT if the job stopped the run early.
+//AUTO runs the fastest algorithm in the tuning profile for the raster's size, seeding the
+//XDRAW compass lines itself since the host won't have.
+extern "C" __declspec (dllexport)
+	int _stdcall stagingJob(float* zArray, int zArrayLengthX,
+	int zArrayLengthY, int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
+	int rasterWidth, int rasterHeight, float* losArray, int gpuType, ViewshedJob* job)
+{
+	TraceScope trace("viewshed", gpuType);
+	int status = VIEWSHED_OK;
+
+	if (gpuType == AUTO)
+	{
+		gpuType = tunedAlgorithm(zArrayLengthX, zArrayLengthY);
+		if (gpuType == XDRAW)
+		{
+			seedXdraw(zArray, visibleArray, losArray, zArrayLengthX, zArrayLengthY, currX, currY, currZ);
+		}
+	}
+
+	if (gpuType == XDRAW)
+	{
+		status = calcXdraw(zArray, zArrayLengthX, zArrayLengthY, visibleArray, visibleArrayX,
+			visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, losArray, job);
+	}
+	else if (gpuType == DDA)
+	{
+		status = calcDDA(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
+			visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, job);
+	}
+	else if (gpuType == R3)
+	{
+		status = calcR3(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
+			visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, job);
+	}
+	else if (gpuType == DDA_EXACT)
+	{
+		status = calcDDAExact(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
+			visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, job);
+	}
+	else if (gpuType == R2)
+	{
+		//calcR2(zArray, zArrayLengthX, zArrayLengthY, visibleArray,
+			//visibleArrayX, visibleArrayY, currX, currY, currZ, rasterWidth, rasterHeight, losArray);
+	}
+
+	return status;
+}
+
+
+extern "C" __declspec (dllexport)
+	void _stdcall staging(float* zArray, int zArrayLengthX,
+	int zArrayLengthY, int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
+	int rasterWidth, int rasterHeight, float* losArray, int gpuType)
+{
+	stagingJob(zArray, zArrayLengthX, zArrayLengthY, visibleArray, visibleArrayX, visibleArrayY, currX, currY, currZ,
+		rasterWidth, rasterHeight, losArray, gpuType, NULL);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingPath(float* zArray, int rasterWidth, int rasterHeight, float cellSize, int* pathX, int* pathY, int* pathZ,
+	int pathLength, float angularTolerance, int* outputArray, int outputMode)
+{
+	return calcPath(zArray, rasterWidth, rasterHeight, cellSize, pathX, pathY, pathZ, pathLength, angularTolerance,
+		outputArray, outputMode);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingHorizon(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int* visibleArray, float* horizonArray, float* minHeightArray)
+{
+	return calcHorizon(zArray, rasterWidth, rasterHeight, currX, currY, currZ, visibleArray, horizonArray, minHeightArray);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingProbabilistic(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int realisations, float errorSigma, int correlationLength, unsigned int seed, float* probabilityArray)
+{
+	return calcProbabilistic(zArray, rasterWidth, rasterHeight, currX, currY, currZ,
+		realisations, errorSigma, correlationLength, seed, probabilityArray);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingLevelOfDetail(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	float angularTolerance, int* visibleArray, int* mismatchCount)
+{
+	return calcLevelOfDetail(zArray, rasterWidth, rasterHeight, currX, currY, currZ, angularTolerance, visibleArray, mismatchCount);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingProgressive(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int coarseLevel, int tileSize, int* visibleArray, volatile LONG* progressCursor, int* tileOrder,
+	ProgressCallback onProgress, ViewshedJob* job)
+{
+	return calcProgressive(zArray, rasterWidth, rasterHeight, currX, currY, currZ, coarseLevel, tileSize,
+		visibleArray, progressCursor, tileOrder, onProgress, job);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingXdrawBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, unsigned int* visibleBits)
+{
+	return calcXdrawBatch(zArray, rasterWidth, rasterHeight, observerX, observerY, observerZ, observerCount,
+		tuningProfile().xdrawObserverBatch, visibleBits);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingValidateXdraw(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+	int* visibleArray, int* mismatchCount)
+{
+	return calcValidateXdraw(zArray, rasterWidth, rasterHeight, currX, currY, currZ, visibleArray, mismatchCount);
 }
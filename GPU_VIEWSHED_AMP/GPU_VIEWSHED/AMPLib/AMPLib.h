@@ -0,0 +1,247 @@
+// AMPLib.h : defines and small helpers shared between the viewshed engines
+//
+
+#pragma once
+
+#include "amp.h"
+#include <functional>
+#include <vector>
+
+
+//Algorithms selected by staging's gpuType
+#define XDRAW 1
+#define SDRAW 2
+#define DDA 3
+#define R3 4
+#define R2 5
+#define DDA_EXACT 6
+#define AUTO 7
+
+//Status codes returned by the exported entry points
+#define VIEWSHED_OK 0
+#define VIEWSHED_BAD_ARGUMENT -1
+#define VIEWSHED_IO_ERROR -2
+#define VIEWSHED_CANCELLED -3
+#define VIEWSHED_TIMED_OUT -4
+#define VIEWSHED_INCOMPLETE -5
+#define VIEWSHED_OUT_OF_MEMORY -6
+
+//Defaults for the sizes the tuning profile can override, see Tuning.cpp
+#define LOS_CHUNK_SIZE 1024
+#define XDRAW_OBSERVER_BATCH 64
+
+//Raster size classes in the tuning profile, floor(log2(cells))
+#define TUNING_SIZE_CLASSES 40
+
+
+//Squared distance of a cell offset, in double so it is exact past the int range of wide rasters
+inline double cellDistSq(int dx, int dy) restrict(cpu, amp)
+{
+	return (double) dx * dx + (double) dy * dy;
+}
+
+
+//Returns true if the slope dz1 / sqrt(distSq1) is at least dz2 / sqrt(distSq2)
+//Both squared distances are positive, so the slopes are compared by cross multiplying
+//the squares and keeping the sign of the height difference. No sqrt or divide is needed,
+//and double multiplies round the same way on every backend. Callers convert float heights
+//and int offsets to double, which needs full double precision, see exactAccelerator
+inline bool slopeAtLeast(double dz1, double distSq1, double dz2, double distSq2) restrict(cpu, amp)
+{
+	if (dz1 >= 0 && dz2 < 0)
+	{
+		return true;
+	}
+	if (dz1 < 0 && dz2 >= 0)
+	{
+		return false;
+	}
+
+	double lhs = dz1 * dz1 * distSq2;
+	double rhs = dz2 * dz2 * distSq1;
+
+	//both below the observer, the smaller magnitude is the steeper slope
+	if (dz1 < 0)
+	{
+		return lhs <= rhs;
+	}
+	return lhs >= rhs;
+}
+
+
+//Cooperative cancellation for long jobs, owned by the caller and shared with the running job.
+//Any thread may set cancelRequested; timeBudgetMs stops the job by itself once that long has
+//passed since the call started, 0 for no limit. The job keeps completed out of total up to
+//date (rings, ray batches or tiles, whichever it works in) so a stopped job says how far it got.
+struct ViewshedJob
+{
+	volatile LONG cancelRequested;
+	LONG timeBudgetMs;
+	volatile LONG completed;
+	volatile LONG total;
+};
+
+
+//Record a job's progress, a null job is ignored
+inline void jobProgress(ViewshedJob* job, int completed, int total)
+{
+	if (job != NULL)
+	{
+		InterlockedExchange(&job->total, total);
+		InterlockedExchange(&job->completed, completed);
+	}
+}
+
+
+//VIEWSHED_OK while a job should keep going, startTicks is GetTickCount64() at the start of the call
+inline int jobStatus(ViewshedJob* job, ULONGLONG startTicks)
+{
+	if (job == NULL)
+	{
+		return VIEWSHED_OK;
+	}
+	if (job->cancelRequested)
+	{
+		return VIEWSHED_CANCELLED;
+	}
+	if (job->timeBudgetMs > 0 && GetTickCount64() - startTicks >= (ULONGLONG) job->timeBudgetMs)
+	{
+		return VIEWSHED_TIMED_OUT;
+	}
+	return VIEWSHED_OK;
+}
+
+
+//Machine tuning, loaded from the profile beside the library on first use, see Tuning.cpp
+struct TuningProfile
+{
+	//Best gpuType by raster size class, 0 where untuned
+	int algorithm[TUNING_SIZE_CLASSES];
+	int xdrawObserverBatch;
+	int losChunkSize;
+};
+
+TuningProfile tuningProfile();
+int tunedAlgorithm(int rasterWidth, int rasterHeight);
+
+//Module handle of the library, set in DllMain
+extern HMODULE libraryModule;
+
+
+//Timeline tracing into per-thread ring buffers, see Trace.cpp. While tracing is off an event
+//costs a load and a branch.
+extern volatile LONG tracingEnabled;
+void traceRecord(const char* name, char phase, int arg);
+
+inline void traceBegin(const char* name, int arg)
+{
+	if (tracingEnabled)
+	{
+		traceRecord(name, 'B', arg);
+	}
+}
+
+inline void traceEnd(const char* name, int arg)
+{
+	if (tracingEnabled)
+	{
+		traceRecord(name, 'E', arg);
+	}
+}
+
+//Begin and end events for a scope, name must outlive the trace (a literal)
+struct TraceScope
+{
+	const char* name;
+	int arg;
+	bool active;
+
+	TraceScope(const char* name, int arg) : name(name), arg(arg), active(tracingEnabled != 0)
+	{
+		if (active)
+		{
+			traceRecord(name, 'B', arg);
+		}
+	}
+
+	~TraceScope()
+	{
+		if (active)
+		{
+			traceRecord(name, 'E', arg);
+		}
+	}
+};
+
+
+//Cells of a DDA ray from the observer towards (dx, dy), steps of them, each snapped to the
+//nearest cell so the steps land on the same cells on every backend. After k calls to next,
+//(x, y) is (dx, dy) * k / steps rounded half away from zero. The offsets are carried as a
+//quotient and remainder, one carry at most per step, so unlike dx * k they can't overflow
+//however long the ray.
+struct RayStepper
+{
+	int steps;
+	int magnitudeX, magnitudeY;
+	int signX, signY;
+	int remainderX, remainderY;
+	int x, y;
+
+	RayStepper(int dx, int dy, int steps) restrict(cpu, amp)
+		: steps(steps), magnitudeX(dx < 0 ? -dx : dx), magnitudeY(dy < 0 ? -dy : dy),
+		signX(dx < 0 ? -1 : 1), signY(dy < 0 ? -1 : 1), remainderX(steps / 2), remainderY(steps / 2), x(0), y(0)
+	{
+	}
+
+	void next() restrict(cpu, amp)
+	{
+		remainderX += magnitudeX;
+		if (remainderX >= steps)
+		{
+			remainderX -= steps;
+			x += signX;
+		}
+		remainderY += magnitudeY;
+		if (remainderY >= steps)
+		{
+			remainderY -= steps;
+			y += signY;
+		}
+	}
+};
+
+
+//Engine entry points shared between translation units, see AMPLib.cpp
+concurrency::accelerator exactAccelerator();
+void traceAllRaysExact(concurrency::accelerator_view av, const concurrency::array_view<const float, 2> &dataViewZ,
+	const concurrency::array_view<int, 2> &dataViewVisible, int currX, int currY, int currZ, int rasterWidth, int rasterHeight);
+
+int calcEachViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, const std::function<void(int, const unsigned int*)> &onViewshed);
+
+extern "C" int _stdcall stagingJob(float* zArray, int zArrayLengthX,
+	int zArrayLengthY, int* visibleArray, int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ,
+	int rasterWidth, int rasterHeight, float* losArray, int gpuType, ViewshedJob* job);
+
+//See TotalViewshed.cpp
+void parallelLines(int rasterWidth, int rasterHeight, float theta,
+	const std::function<void(const std::vector<int>&, float)> &onLine);
+
+int calcXdrawBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int batchSize, unsigned int* visibleBits);
+
+//See LineOfSight.cpp
+int calcLineOfSight(float* zArray, int rasterWidth, int rasterHeight,
+	int* observerX, int* observerY, float* observerHeight, int* targetX, int* targetY, float* targetHeight,
+	int pairCount, int stopAtFirstObstruction, int chunkSize, int* visibleArray, float* clearanceArray);
+
+//See ResultCache.cpp
+unsigned long long demContentHash(const float* zArray, int cellCount);
+void writeVarint(std::vector<unsigned char> &out, unsigned int v);
+bool readVarint(const unsigned char* in, size_t size, size_t &pos, unsigned int &v);
+
+//See SharedBuffers.cpp
+int calcCreateBuffers(int rasterWidth, int rasterHeight, int useLargePages, float** zArray, int** visibleArray, int* usedLargePages);
+int calcBuffered(int handle, int currX, int currY, int currZ, int gpuType, ViewshedJob* job);
+int calcFreeBuffers(int handle);
+void seedXdraw(float* zArray, int* visibleArray, float* losArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ);
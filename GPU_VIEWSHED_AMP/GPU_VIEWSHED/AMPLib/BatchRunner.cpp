@@ -0,0 +1,403 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+
+#define BATCH_MANIFEST "manifest.txt"
+#define BATCH_DEM "dem.raw"
+#define BATCH_CUMULATIVE "cumulative.raw"
+
+
+
+//rundll32 looks the worker up by its undecorated name
+#pragma comment(linker, "/EXPORT:stagingShardWorker=_stagingShardWorker@16")
+
+
+//Sharded batch runner: cumulative viewshed of a long observer list across worker processes
+//
+//A batch lives in a job directory: the DEM as raw floats (BATCH_DEM), and a text manifest of
+//the raster size, shard size and observers. The observer list is cut into shards of
+//shardObservers observers. A worker maps the DEM read-only, so every worker on a node shares
+//one copy through the file cache, and claims shards one at a time by creating
+//shard_<n>.claim. The claim is opened delete on close, so it goes away when the worker does,
+//even if it crashes. For each claimed shard the worker writes shard_<n>.cnt, how many of the
+//shard's observers see each cell, through a temporary file and a rename.
+//
+//Workers are rundll32 processes running stagingShardWorker. Any number of nodes can run
+//stagingRunBatch on the same job directory on a shared filesystem; they claim shards from
+//one pool. A finished shard file is never recomputed, so running the batch again resumes it,
+//and stagingMergeBatch sums the shards into the cumulative viewshed.
+
+
+struct BatchManifest
+{
+	int rasterWidth;
+	int rasterHeight;
+	int shardObservers;
+	std::vector<int> observerX;
+	std::vector<int> observerY;
+	std::vector<int> observerZ;
+
+	int shardCount() const
+	{
+		return ((int) observerX.size() + shardObservers - 1) / shardObservers;
+	}
+};
+
+
+std::string batchPath(const std::string &jobDir, const std::string &name)
+{
+	return jobDir + "\\" + name;
+}
+
+
+std::string shardPath(const std::string &jobDir, int shard, const char* extension)
+{
+	std::ostringstream name;
+	name << "shard_" << shard << extension;
+	return batchPath(jobDir, name.str());
+}
+
+
+bool fileExists(const std::string &path)
+{
+	return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+
+std::string manifestText(const BatchManifest &m)
+{
+	std::ostringstream text;
+	text << "size " << m.rasterWidth << " " << m.rasterHeight << "\n";
+	text << "shardObservers " << m.shardObservers << "\n";
+	text << "observers " << m.observerX.size() << "\n";
+	for (int i = 0; i < (int) m.observerX.size(); i++)
+	{
+		text << m.observerX[i] << " " << m.observerY[i] << " " << m.observerZ[i] << "\n";
+	}
+	return text.str();
+}
+
+
+std::string readText(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	std::ostringstream text;
+	text << file.rdbuf();
+	return text.str();
+}
+
+
+bool readManifest(const std::string &jobDir, BatchManifest &m)
+{
+	std::istringstream text(readText(batchPath(jobDir, BATCH_MANIFEST)));
+	std::string key;
+	int observerCount = 0;
+
+	text >> key >> m.rasterWidth >> m.rasterHeight;
+	text >> key >> m.shardObservers;
+	text >> key >> observerCount;
+	if (!text || m.rasterWidth <= 0 || m.rasterHeight <= 0 || m.shardObservers <= 0 || observerCount <= 0)
+	{
+		return false;
+	}
+
+	m.observerX.resize(observerCount);
+	m.observerY.resize(observerCount);
+	m.observerZ.resize(observerCount);
+	for (int i = 0; i < observerCount; i++)
+	{
+		text >> m.observerX[i] >> m.observerY[i] >> m.observerZ[i];
+	}
+	return !text.fail();
+}
+
+
+//Writes the DEM and manifest into jobDir, created if missing. When jobDir already holds the
+//same batch it is left alone so completed shards are kept; a different batch replaces it.
+int calcPrepareBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int shardObservers, const char* jobDir)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0 || observerCount <= 0 || shardObservers <= 0 || jobDir == NULL)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	BatchManifest m;
+	m.rasterWidth = rasterWidth;
+	m.rasterHeight = rasterHeight;
+	m.shardObservers = shardObservers;
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+		m.observerX.push_back(observerX[i]);
+		m.observerY.push_back(observerY[i]);
+		m.observerZ.push_back(observerZ[i]);
+	}
+
+	std::string dir(jobDir);
+	std::string text = manifestText(m);
+	std::string demPath = batchPath(dir, BATCH_DEM);
+	std::vector<float> existingDem;
+
+	if (readText(batchPath(dir, BATCH_MANIFEST)) == text)
+	{
+		existingDem.resize(rasterWidth * rasterHeight);
+		std::ifstream dem(demPath.c_str(), std::ios::binary);
+		if (dem.read((char*) &existingDem[0], existingDem.size() * sizeof(float))
+			&& memcmp(&existingDem[0], zArray, existingDem.size() * sizeof(float)) == 0)
+		{
+			return VIEWSHED_OK;
+		}
+	}
+
+	//A new batch, stale shards from an earlier one must not be merged into it
+	CreateDirectoryA(jobDir, NULL);
+	DeleteFileA(batchPath(dir, BATCH_MANIFEST).c_str());
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA(batchPath(dir, "shard_*.cnt").c_str(), &found);
+	if (search != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			DeleteFileA(batchPath(dir, found.cFileName).c_str());
+		} while (FindNextFileA(search, &found));
+		FindClose(search);
+	}
+
+	std::ofstream dem(demPath.c_str(), std::ios::binary | std::ios::trunc);
+	dem.write((const char*) zArray, (std::streamsize) rasterWidth * rasterHeight * sizeof(float));
+	dem.close();
+
+	//The manifest goes last, a batch without one is not ready
+	std::ofstream manifest(batchPath(dir, BATCH_MANIFEST).c_str(), std::ios::binary | std::ios::trunc);
+	manifest << text;
+	manifest.close();
+
+	return dem.fail() || manifest.fail() ? VIEWSHED_IO_ERROR : VIEWSHED_OK;
+}
+
+
+//Claims and computes shards until none are left unclaimed
+int calcBatchWorker(const std::string &jobDir)
+{
+	BatchManifest m;
+	if (!readManifest(jobDir, m))
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	int cells = m.rasterWidth * m.rasterHeight;
+	HANDLE demFile = CreateFileA(batchPath(jobDir, BATCH_DEM).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (demFile == INVALID_HANDLE_VALUE)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+	HANDLE mapping = CreateFileMappingA(demFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	float* zArray = mapping == NULL ? NULL : (float*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, cells * sizeof(float));
+	if (zArray == NULL)
+	{
+		if (mapping != NULL)
+		{
+			CloseHandle(mapping);
+		}
+		CloseHandle(demFile);
+		return VIEWSHED_IO_ERROR;
+	}
+
+	int status = VIEWSHED_OK;
+	std::vector<unsigned int> counts(cells);
+	for (int shard = 0; shard < m.shardCount() && status == VIEWSHED_OK; shard++)
+	{
+		std::string resultPath = shardPath(jobDir, shard, ".cnt");
+		if (fileExists(resultPath))
+		{
+			continue;
+		}
+		HANDLE claim = CreateFileA(shardPath(jobDir, shard, ".claim").c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (claim == INVALID_HANDLE_VALUE)
+		{
+			continue;
+		}
+		//finished between the check and the claim
+		if (fileExists(resultPath))
+		{
+			CloseHandle(claim);
+			continue;
+		}
+
+		TraceScope trace("shard", shard);
+		int first = shard * m.shardObservers;
+		int count = min(m.shardObservers, (int) m.observerX.size() - first);
+		memset(&counts[0], 0, cells * sizeof(unsigned int));
+		status = calcEachViewshed(zArray, m.rasterWidth, m.rasterHeight, &m.observerX[first], &m.observerY[first], &m.observerZ[first],
+			count, [&](int, const unsigned int* bits)
+		{
+			for (int i = 0; i < cells; i++)
+			{
+				counts[i] += (bits[i >> 5] >> (i & 31)) & 1;
+			}
+		});
+
+		if (status == VIEWSHED_OK)
+		{
+			std::string temp = shardPath(jobDir, shard, ".tmp");
+			std::ofstream file(temp.c_str(), std::ios::binary | std::ios::trunc);
+			file.write((const char*) &counts[0], cells * sizeof(unsigned int));
+			file.close();
+			if (file.fail() || !MoveFileExA(temp.c_str(), resultPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+			{
+				status = VIEWSHED_IO_ERROR;
+			}
+		}
+		CloseHandle(claim);
+	}
+
+	UnmapViewOfFile(zArray);
+	CloseHandle(mapping);
+	CloseHandle(demFile);
+	return status;
+}
+
+
+//Runs workerCount worker processes on jobDir and waits for them. VIEWSHED_INCOMPLETE when
+//shards are still missing afterwards, failed or still being worked on by another node.
+int calcRunBatch(const char* jobDir, int workerCount)
+{
+	BatchManifest m;
+	if (jobDir == NULL || workerCount <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	if (!readManifest(jobDir, m))
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	char modulePath[MAX_PATH] = "";
+	GetModuleFileNameA(libraryModule, modulePath, MAX_PATH);
+	std::string commandLine = std::string("rundll32.exe \"") + modulePath + "\",stagingShardWorker \"" + jobDir + "\"";
+
+	std::vector<HANDLE> workers;
+	for (int i = 0; i < workerCount; i++)
+	{
+		STARTUPINFOA startup;
+		PROCESS_INFORMATION process;
+		memset(&startup, 0, sizeof(startup));
+		startup.cb = sizeof(startup);
+
+		std::vector<char> command(commandLine.begin(), commandLine.end());
+		command.push_back(0);
+		if (CreateProcessA(NULL, &command[0], NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &startup, &process))
+		{
+			CloseHandle(process.hThread);
+			workers.push_back(process.hProcess);
+		}
+	}
+	if (workers.empty())
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	for (int i = 0; i < (int) workers.size(); i++)
+	{
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+
+	for (int shard = 0; shard < m.shardCount(); shard++)
+	{
+		if (!fileExists(shardPath(jobDir, shard, ".cnt")))
+		{
+			return VIEWSHED_INCOMPLETE;
+		}
+	}
+	return VIEWSHED_OK;
+}
+
+
+//Sums the finished shards into cumulativeArray, rasterWidth x height observer counts, and
+//writes it to BATCH_CUMULATIVE. VIEWSHED_INCOMPLETE, with the partial sum, when shards are missing.
+int calcMergeBatch(const char* jobDir, int* cumulativeArray)
+{
+	BatchManifest m;
+	if (jobDir == NULL)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	if (!readManifest(jobDir, m))
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	int cells = m.rasterWidth * m.rasterHeight;
+	int status = VIEWSHED_OK;
+	std::vector<unsigned int> counts(cells);
+	memset(cumulativeArray, 0, cells * sizeof(int));
+
+	for (int shard = 0; shard < m.shardCount(); shard++)
+	{
+		std::ifstream file(shardPath(jobDir, shard, ".cnt").c_str(), std::ios::binary);
+		if (!file.read((char*) &counts[0], cells * sizeof(unsigned int)))
+		{
+			status = VIEWSHED_INCOMPLETE;
+			continue;
+		}
+		for (int i = 0; i < cells; i++)
+		{
+			cumulativeArray[i] += counts[i];
+		}
+	}
+
+	std::ofstream file(batchPath(jobDir, BATCH_CUMULATIVE).c_str(), std::ios::binary | std::ios::trunc);
+	file.write((const char*) cumulativeArray, cells * sizeof(int));
+	file.close();
+	if (file.fail() && status == VIEWSHED_OK)
+	{
+		status = VIEWSHED_IO_ERROR;
+	}
+	return status;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingPrepareBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int shardObservers, const char* jobDir)
+{
+	return calcPrepareBatch(zArray, rasterWidth, rasterHeight, observerX, observerY, observerZ, observerCount, shardObservers, jobDir);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingRunBatch(const char* jobDir, int workerCount)
+{
+	return calcRunBatch(jobDir, workerCount);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingMergeBatch(const char* jobDir, int* cumulativeArray)
+{
+	return calcMergeBatch(jobDir, cumulativeArray);
+}
+
+
+//rundll32 entry point, commandLine is the job directory
+extern "C" __declspec (dllexport)
+	void CALLBACK stagingShardWorker(HWND window, HINSTANCE instance, char* commandLine, int show)
+{
+	std::string jobDir(commandLine);
+	size_t first = jobDir.find_first_not_of(" \t\"");
+	size_t last = jobDir.find_last_not_of(" \t\"");
+	calcBatchWorker(first == std::string::npos ? std::string() : jobDir.substr(first, last - first + 1));
+}
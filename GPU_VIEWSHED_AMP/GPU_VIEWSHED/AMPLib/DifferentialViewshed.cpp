@@ -0,0 +1,328 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+
+#define DIFF_PI 3.14159265358979
+
+
+
+using namespace concurrency;
+
+
+//Differential viewshed: patch existing DDA_EXACT visibility after part of the DEM changed
+//
+//An exact DDA ray only sees the edit if its snapped cells land inside the edited box, so only
+//cells beyond the box, inside the angular sector it subtends from the observer, can change.
+//Those cells are cleared and re-traced with every ray that can reach them; the rest of the
+//raster is left alone, and only the rows and columns the sector crosses are scanned for them.
+//Given DDA_EXACT rasters of the old DEM the result is meant to match a full DDA_EXACT run on
+//the edited one.
+
+
+//Angle of (dx, dy) relative to centreAngle, in (-pi, pi]
+double relativeAngle(double dx, double dy, double centreAngle)
+{
+	double a = atan2(dy, dx) - centreAngle;
+	while (a > DIFF_PI)
+	{
+		a -= 2 * DIFF_PI;
+	}
+	while (a <= -DIFF_PI)
+	{
+		a += 2 * DIFF_PI;
+	}
+	return a;
+}
+
+
+//Cells that may change, flagged over the bounding box of the sector rather than the raster
+struct PatchMask
+{
+	int minX;
+	int minY;
+	int width;
+	int height;
+	std::vector<char> flags;
+
+	bool contains(int x, int y) const
+	{
+		x -= minX;
+		y -= minY;
+		return x >= 0 && x < width && y >= 0 && y < height && flags[y * width + x] != 0;
+	}
+};
+
+
+//CPU copy of traceRayExact that only writes cells flagged in patchMask
+void traceRayPatch(const float* zArray, int rasterWidth, int* visibleArray, const PatchMask &patchMask,
+	int currX, int currY, int currZ, int destX, int destY)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(abs(dx), abs(dy));
+
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double dz = (double) zArray[y * rasterWidth + x] - currZ;
+
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			if (patchMask.contains(x, y))
+			{
+				visibleArray[y * rasterWidth + x] = 1;
+			}
+			highestZ = dz;
+			highestDistSq = distSq;
+		}
+	}
+}
+
+
+//Range of x, relative to the observer, where row dy can enter the cone between angles lo and hi
+//(radians, hi - lo under pi). Each side of the cone is a half plane, a bound on x for the row.
+//Returns false if the row misses the cone.
+bool coneRowRange(double lo, double hi, double dy, double &fromX, double &toX)
+{
+	double limit = 1e30;
+	fromX = -limit;
+	toX = limit;
+
+	//left of the lo side: cos(lo) * dy - sin(lo) * dx >= 0
+	double s = sin(lo);
+	double c = cos(lo);
+	if (fabs(s) < 1e-12)
+	{
+		if (c * dy < 0)
+		{
+			return false;
+		}
+	}
+	else if (s > 0)
+	{
+		toX = min(toX, c * dy / s);
+	}
+	else
+	{
+		fromX = max(fromX, c * dy / s);
+	}
+
+	//right of the hi side: sin(hi) * dx - cos(hi) * dy >= 0
+	s = sin(hi);
+	c = cos(hi);
+	if (fabs(s) < 1e-12)
+	{
+		if (c * dy > 0)
+		{
+			return false;
+		}
+	}
+	else if (s > 0)
+	{
+		fromX = max(fromX, c * dy / s);
+	}
+	else
+	{
+		toX = min(toX, c * dy / s);
+	}
+
+	return fromX <= toX;
+}
+
+
+//Patch one observer's visibility raster, returns the number of cells that changed
+int patchObserver(float* zArray, int rasterWidth, int rasterHeight, int editMinX, int editMinY, int editMaxX, int editMaxY,
+	int currX, int currY, int currZ, int* visibleArray)
+{
+	//Snapped DDA cells are within half a cell of the true ray
+	double boxMinX = editMinX - 0.5 - currX;
+	double boxMinY = editMinY - 0.5 - currY;
+	double boxMaxX = editMaxX + 0.5 - currX;
+	double boxMaxY = editMaxY + 0.5 - currY;
+
+	bool insideBox = boxMinX <= 0 && boxMaxX >= 0 && boxMinY <= 0 && boxMaxY >= 0;
+
+	//Sector the box subtends, as angles relative to the direction of its centre
+	double centreAngle = atan2((boxMinY + boxMaxY) / 2, (boxMinX + boxMaxX) / 2);
+	double cornersX[4] = { boxMinX, boxMaxX, boxMinX, boxMaxX };
+	double cornersY[4] = { boxMinY, boxMinY, boxMaxY, boxMaxY };
+	double sectorMin = 0.0;
+	double sectorMax = 0.0;
+	for (int c = 0; c < 4; c++)
+	{
+		double a = relativeAngle(cornersX[c], cornersY[c], centreAngle);
+		sectorMin = c == 0 ? a : min(sectorMin, a);
+		sectorMax = c == 0 ? a : max(sectorMax, a);
+	}
+
+	//Closest the box comes to the observer
+	double nearX = max(0.0, max(boxMinX, -boxMaxX));
+	double nearY = max(0.0, max(boxMinY, -boxMaxY));
+	double nearDist = sqrt(nearX * nearX + nearY * nearY);
+
+	//A snapped cell is within half a cell of its ray, so its centre can sit a little closer
+	//than the ray point it stands for, and its angle is within cellMargin of any ray through it
+	double patchDist = max(nearDist - 0.75, 0.5);
+	double cellMargin = insideBox ? DIFF_PI : atan(0.75 / patchDist);
+
+	//Columns each row can have in the sector, a cell either side for its margin. A sector of pi
+	//or more isn't convex and keeps the whole row.
+	double lo = centreAngle + sectorMin - cellMargin;
+	double hi = centreAngle + sectorMax + cellMargin;
+	bool convex = !insideBox && hi - lo < DIFF_PI;
+	std::vector<int> rowFrom(rasterHeight, 0);
+	std::vector<int> rowTo(rasterHeight, rasterWidth - 1);
+	int minX = rasterWidth;
+	int maxX = -1;
+	int minY = rasterHeight;
+	int maxY = -1;
+	for (int y = 0; y < rasterHeight; y++)
+	{
+		if (convex)
+		{
+			double fromX;
+			double toX;
+			if (!coneRowRange(lo, hi, y - currY, fromX, toX))
+			{
+				rowTo[y] = -1;
+				continue;
+			}
+			//clamped before the casts, an open side is +-1e30
+			rowFrom[y] = (int) min((double) rasterWidth, max(0.0, floor(fromX + currX) - 1));
+			rowTo[y] = (int) max(-1.0, min(rasterWidth - 1.0, ceil(toX + currX) + 1));
+		}
+		if (rowFrom[y] <= rowTo[y])
+		{
+			minX = min(minX, rowFrom[y]);
+			maxX = max(maxX, rowTo[y]);
+			minY = min(minY, y);
+			maxY = max(maxY, y);
+		}
+	}
+
+	//Cells that could change
+	PatchMask patchMask;
+	patchMask.minX = minX;
+	patchMask.minY = minY;
+	patchMask.width = max(maxX - minX + 1, 0);
+	patchMask.height = max(maxY - minY + 1, 0);
+	patchMask.flags.assign(patchMask.width * patchMask.height, 0);
+	std::vector<int> patchCells;
+	for (int y = max(minY, 0); y <= maxY; y++)
+	{
+		for (int x = rowFrom[y]; x <= rowTo[y]; x++)
+		{
+			double cx = x - currX;
+			double cy = y - currY;
+			if (x == currX && y == currY)
+			{
+				continue;
+			}
+			if (!insideBox)
+			{
+				if (cx * cx + cy * cy < patchDist * patchDist)
+				{
+					continue;
+				}
+				double a = relativeAngle(cx, cy, centreAngle);
+				if (a < sectorMin - cellMargin || a > sectorMax + cellMargin)
+				{
+					continue;
+				}
+			}
+			patchMask.flags[(y - minY) * patchMask.width + x - minX] = 1;
+			patchCells.push_back(y * rasterWidth + x);
+		}
+	}
+
+	std::vector<int> oldValues(patchCells.size());
+	for (int i = 0; i < (int) patchCells.size(); i++)
+	{
+		oldValues[i] = visibleArray[patchCells[i]];
+		visibleArray[patchCells[i]] = 0;
+	}
+
+	//Every ray that can reach a patched cell, rays run to each edge cell as in traceAllRaysExact
+	std::vector<int> destinations;
+	for (int i = 0; i < 2 * (rasterWidth + rasterHeight); i++)
+	{
+		int destX = i < rasterHeight ? 0 : i < 2 * rasterHeight ? rasterWidth - 1 : i < 2 * rasterHeight + rasterWidth ? i - 2 * rasterHeight : i - 2 * rasterHeight - rasterWidth;
+		int destY = i < rasterHeight ? i : i < 2 * rasterHeight ? i - rasterHeight : i < 2 * rasterHeight + rasterWidth ? 0 : rasterHeight - 1;
+
+		if (!insideBox)
+		{
+			double a = relativeAngle(destX - currX, destY - currY, centreAngle);
+			if (a < sectorMin - 2 * cellMargin || a > sectorMax + 2 * cellMargin)
+			{
+				continue;
+			}
+		}
+		destinations.push_back(destY * rasterWidth + destX);
+	}
+
+	parallel_for(0, (int) destinations.size(), [&](int r)
+	{
+		traceRayPatch(zArray, rasterWidth, visibleArray, patchMask, currX, currY, currZ,
+			destinations[r] % rasterWidth, destinations[r] / rasterWidth);
+	});
+
+	int changed = 0;
+	for (int i = 0; i < (int) patchCells.size(); i++)
+	{
+		if (visibleArray[patchCells[i]] != oldValues[i])
+		{
+			changed++;
+		}
+	}
+	return changed;
+}
+
+
+//zArray is the edited DEM and the box [editMin, editMax] holds every changed cell.
+//visibleArrays holds observerCount rasterWidth x rasterHeight DDA_EXACT visibility rasters,
+//patched in place. changedCounts receives the number of cells that flipped per observer.
+int calcPatch(float* zArray, int rasterWidth, int rasterHeight, int editMinX, int editMinY, int editMaxX, int editMaxY,
+	int* observerX, int* observerY, int* observerZ, int observerCount, int* visibleArrays, int* changedCounts)
+{
+	if (editMinX > editMaxX || editMinY > editMaxY)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	for (int i = 0; i < observerCount; i++)
+	{
+		changedCounts[i] = patchObserver(zArray, rasterWidth, rasterHeight, editMinX, editMinY, editMaxX, editMaxY,
+			observerX[i], observerY[i], observerZ[i], visibleArrays + (size_t) i * rasterWidth * rasterHeight);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingPatch(float* zArray, int rasterWidth, int rasterHeight, int editMinX, int editMinY, int editMaxX, int editMaxY,
+	int* observerX, int* observerY, int* observerZ, int observerCount, int* visibleArrays, int* changedCounts)
+{
+	return calcPatch(zArray, rasterWidth, rasterHeight, editMinX, editMinY, editMaxX, editMaxY,
+		observerX, observerY, observerZ, observerCount, visibleArrays, changedCounts);
+}
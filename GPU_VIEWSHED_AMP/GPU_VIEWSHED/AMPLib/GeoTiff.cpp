@@ -0,0 +1,430 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <fstream>
+#include <cstring>
+
+
+//Sample types of the written raster
+#define GEOTIFF_BYTE 1
+#define GEOTIFF_INT32 2
+#define GEOTIFF_FLOAT32 3
+
+#define LZW_CLEAR 256
+#define LZW_END 257
+#define LZW_FIRST 258
+#define LZW_MAX_BITS 12
+#define LZW_HASH_SIZE 16384
+
+//Classic TIFF offsets are 32 bit, bigger files are written as BigTIFF
+#define TIFF_CLASSIC_LIMIT 0xFFFFFF00ULL
+
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_DOUBLE 12
+#define TIFF_LONG8 16
+
+
+
+using namespace concurrency;
+
+
+//Cloud optimised GeoTIFF writer for visibility bitmaps, counts and float rasters
+//
+//The raster is cut into tileSize square tiles, each compressed on its own, in parallel, with
+//TIFF LZW after a predictor: horizontal differencing for integers, the floating point
+//predictor (bytes split into planes, then differenced) for floats. The file is laid out the
+//way COG readers expect: header, then the IFD and all of its tag data, then the tiles in row
+//order, so one small read at the start finds every tile.
+//
+//geoTransform is the usual six coefficients: x = gt[0] + col * gt[1] + row * gt[2],
+//y = gt[3] + col * gt[4] + row * gt[5], written as a pixel scale and tie point, or as a model
+//transformation when rotated. epsg, when not 0, is recorded as the projected or, for codes
+//4000 to 4999, geographic coordinate system.
+
+
+//Appends codes most significant bit first, as TIFF LZW wants
+struct BitWriter
+{
+	std::vector<unsigned char> &out;
+	unsigned int buffer;
+	int bits;
+
+	BitWriter(std::vector<unsigned char> &out) : out(out), buffer(0), bits(0)
+	{
+	}
+
+	void put(int code, int width)
+	{
+		buffer = (buffer << width) | code;
+		bits += width;
+		while (bits >= 8)
+		{
+			bits -= 8;
+			out.push_back((unsigned char) (buffer >> bits));
+		}
+	}
+
+	void flush()
+	{
+		if (bits > 0)
+		{
+			out.push_back((unsigned char) (buffer << (8 - bits)));
+		}
+		bits = 0;
+	}
+};
+
+
+//TIFF LZW with the early code width change readers expect: the width grows when the next free
+//code no longer fits, and the table is cleared when it reaches 4094
+void lzwEncode(const std::vector<unsigned char> &in, std::vector<unsigned char> &out)
+{
+	std::vector<int> hashKey(LZW_HASH_SIZE);
+	std::vector<short> hashCode(LZW_HASH_SIZE);
+	BitWriter writer(out);
+
+	int width = 9;
+	int nextCode = LZW_FIRST;
+	writer.put(LZW_CLEAR, width);
+	std::fill(hashKey.begin(), hashKey.end(), -1);
+
+	int prefix = in[0];
+	for (size_t i = 1; i < in.size(); i++)
+	{
+		int key = (prefix << 8) | in[i];
+		int slot = (key * 40503) & (LZW_HASH_SIZE - 1);
+		while (hashKey[slot] != -1 && hashKey[slot] != key)
+		{
+			slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+		}
+		if (hashKey[slot] == key)
+		{
+			prefix = hashCode[slot];
+			continue;
+		}
+
+		writer.put(prefix, width);
+		hashKey[slot] = key;
+		hashCode[slot] = (short) nextCode++;
+		prefix = in[i];
+
+		if (nextCode == (1 << LZW_MAX_BITS) - 2)
+		{
+			writer.put(LZW_CLEAR, width);
+			width = 9;
+			nextCode = LZW_FIRST;
+			std::fill(hashKey.begin(), hashKey.end(), -1);
+		}
+		else if (nextCode > (1 << width) - 1)
+		{
+			width++;
+		}
+	}
+
+	//The reader adds a table entry after this code too, so the end code may be one bit wider
+	writer.put(prefix, width);
+	nextCode++;
+	if (nextCode == (1 << LZW_MAX_BITS) - 2)
+	{
+		writer.put(LZW_CLEAR, width);
+		width = 9;
+	}
+	else if (nextCode > (1 << width) - 1)
+	{
+		width++;
+	}
+	writer.put(LZW_END, width);
+	writer.flush();
+}
+
+
+//One tile's bytes, zero padded past the raster edge, with the predictor applied
+void encodeTile(const void* raster, int rasterWidth, int rasterHeight, int sampleType, int tileSize,
+	int tileX, int tileY, std::vector<unsigned char> &tile)
+{
+	int sampleBytes = sampleType == GEOTIFF_BYTE ? 1 : 4;
+	int rowBytes = tileSize * sampleBytes;
+	tile.assign(rowBytes * tileSize, 0);
+
+	int x0 = tileX * tileSize;
+	int y0 = tileY * tileSize;
+	int columns = min(tileSize, rasterWidth - x0);
+	std::vector<unsigned char> planes(rowBytes);
+
+	for (int y = 0; y < tileSize && y0 + y < rasterHeight; y++)
+	{
+		unsigned char* row = &tile[y * rowBytes];
+		if (sampleType == GEOTIFF_BYTE)
+		{
+			const int* source = (const int*) raster + (size_t) (y0 + y) * rasterWidth + x0;
+			for (int x = 0; x < columns; x++)
+			{
+				row[x] = (unsigned char) source[x];
+			}
+			for (int x = tileSize - 1; x > 0; x--)
+			{
+				row[x] -= row[x - 1];
+			}
+		}
+		else if (sampleType == GEOTIFF_INT32)
+		{
+			const int* source = (const int*) raster + (size_t) (y0 + y) * rasterWidth + x0;
+			int* samples = (int*) row;
+			memcpy(samples, source, columns * sizeof(int));
+			for (int x = tileSize - 1; x > 0; x--)
+			{
+				samples[x] -= samples[x - 1];
+			}
+		}
+		else
+		{
+			//Floating point predictor: byte planes most significant first, then byte differences
+			const float* source = (const float*) raster + (size_t) (y0 + y) * rasterWidth + x0;
+			memcpy(row, source, columns * sizeof(float));
+			for (int x = 0; x < tileSize; x++)
+			{
+				for (int b = 0; b < 4; b++)
+				{
+					planes[b * tileSize + x] = row[x * 4 + 3 - b];
+				}
+			}
+			for (int i = rowBytes - 1; i > 0; i--)
+			{
+				planes[i] -= planes[i - 1];
+			}
+			memcpy(row, &planes[0], rowBytes);
+		}
+	}
+}
+
+
+struct TiffEntry
+{
+	unsigned short tag;
+	unsigned short type;
+	unsigned long long count;
+	std::vector<unsigned char> data;
+};
+
+
+template<typename T>
+TiffEntry tiffEntry(unsigned short tag, unsigned short type, const T* values, int count)
+{
+	TiffEntry e;
+	e.tag = tag;
+	e.type = type;
+	e.count = count;
+	e.data.resize(count * sizeof(T));
+	memcpy(&e.data[0], values, e.data.size());
+	return e;
+}
+
+
+TiffEntry tiffShort(unsigned short tag, unsigned short value)
+{
+	return tiffEntry(tag, TIFF_SHORT, &value, 1);
+}
+
+
+TiffEntry tiffLong(unsigned short tag, unsigned int value)
+{
+	return tiffEntry(tag, TIFF_LONG, &value, 1);
+}
+
+
+//Tile offsets or byte counts, 32 or 64 bit
+TiffEntry tiffOffsets(unsigned short tag, const std::vector<unsigned long long> &values, bool big)
+{
+	if (big)
+	{
+		return tiffEntry(tag, TIFF_LONG8, &values[0], (int) values.size());
+	}
+	std::vector<unsigned int> narrow(values.begin(), values.end());
+	return tiffEntry(tag, TIFF_LONG, &narrow[0], (int) narrow.size());
+}
+
+
+void appendBytes(std::vector<unsigned char> &out, const void* bytes, size_t count)
+{
+	out.insert(out.end(), (const unsigned char*) bytes, (const unsigned char*) bytes + count);
+}
+
+
+//Header, IFD and tag data for the tiles placed straight after it
+void tiffHeader(const std::vector<TiffEntry> &entries, bool big, std::vector<unsigned char> &out)
+{
+	int offsetBytes = big ? 8 : 4;
+	unsigned long long ifdOffset = big ? 16 : 8;
+	unsigned long long dataOffset = ifdOffset + (big ? 8 : 2) + entries.size() * (big ? 20 : 12) + offsetBytes;
+
+	out.clear();
+	unsigned short magic[2] = { 0x4949, (unsigned short) (big ? 43 : 42) };
+	appendBytes(out, magic, 4);
+	if (big)
+	{
+		unsigned short bigHeader[2] = { 8, 0 };
+		appendBytes(out, bigHeader, 4);
+	}
+	appendBytes(out, &ifdOffset, offsetBytes);
+
+	std::vector<unsigned char> data;
+	unsigned long long count = entries.size();
+	appendBytes(out, &count, big ? 8 : 2);
+	for (int i = 0; i < (int) entries.size(); i++)
+	{
+		const TiffEntry &e = entries[i];
+		appendBytes(out, &e.tag, 2);
+		appendBytes(out, &e.type, 2);
+		appendBytes(out, &e.count, offsetBytes);
+
+		unsigned char value[8] = { 0 };
+		if ((int) e.data.size() <= offsetBytes)
+		{
+			memcpy(value, &e.data[0], e.data.size());
+		}
+		else
+		{
+			unsigned long long offset = dataOffset + data.size();
+			memcpy(value, &offset, offsetBytes);
+			appendBytes(data, &e.data[0], e.data.size());
+			//word aligned, as the spec asks
+			if (data.size() & 1)
+			{
+				data.push_back(0);
+			}
+		}
+		appendBytes(out, value, offsetBytes);
+	}
+	unsigned long long nextIfd = 0;
+	appendBytes(out, &nextIfd, offsetBytes);
+	out.insert(out.end(), data.begin(), data.end());
+}
+
+
+void tiffLayout(std::vector<TiffEntry> &entries, int tileOffsetsEntry, const std::vector<unsigned long long> &offsets,
+	const std::vector<unsigned long long> &byteCounts, bool big, std::vector<unsigned char> &header)
+{
+	entries[tileOffsetsEntry] = tiffOffsets(324, offsets, big);
+	entries[tileOffsetsEntry + 1] = tiffOffsets(325, byteCounts, big);
+	tiffHeader(entries, big, header);
+}
+
+
+//raster is int for GEOTIFF_BYTE and GEOTIFF_INT32, float for GEOTIFF_FLOAT32. geoTransform may
+//be NULL for a raster without georeferencing.
+int calcWriteGeoTiff(const char* path, const void* raster, int rasterWidth, int rasterHeight, int sampleType,
+	const double* geoTransform, int epsg, int tileSize)
+{
+	if (path == NULL || rasterWidth <= 0 || rasterHeight <= 0 || tileSize < 16 || tileSize % 16 != 0
+		|| (sampleType != GEOTIFF_BYTE && sampleType != GEOTIFF_INT32 && sampleType != GEOTIFF_FLOAT32))
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	int tilesAcross = (rasterWidth + tileSize - 1) / tileSize;
+	int tilesDown = (rasterHeight + tileSize - 1) / tileSize;
+	int tileCount = tilesAcross * tilesDown;
+
+	std::vector<std::vector<unsigned char> > tiles(tileCount);
+	parallel_for(0, tileCount, [&](int t)
+	{
+		std::vector<unsigned char> raw;
+		encodeTile(raster, rasterWidth, rasterHeight, sampleType, tileSize, t % tilesAcross, t / tilesAcross, raw);
+		lzwEncode(raw, tiles[t]);
+	});
+
+	std::vector<unsigned long long> byteCounts(tileCount);
+	unsigned long long tileBytes = 0;
+	for (int t = 0; t < tileCount; t++)
+	{
+		byteCounts[t] = tiles[t].size();
+		tileBytes += tiles[t].size();
+	}
+
+	//Tags, in ascending order
+	std::vector<TiffEntry> entries;
+	entries.push_back(tiffLong(256, rasterWidth));
+	entries.push_back(tiffLong(257, rasterHeight));
+	entries.push_back(tiffShort(258, sampleType == GEOTIFF_BYTE ? 8 : 32));
+	entries.push_back(tiffShort(259, 5));
+	entries.push_back(tiffShort(262, 1));
+	entries.push_back(tiffShort(277, 1));
+	entries.push_back(tiffShort(284, 1));
+	entries.push_back(tiffShort(317, sampleType == GEOTIFF_FLOAT32 ? 3 : 2));
+	entries.push_back(tiffLong(322, tileSize));
+	entries.push_back(tiffLong(323, tileSize));
+	int tileOffsetsEntry = (int) entries.size();
+	entries.push_back(TiffEntry());
+	entries.push_back(TiffEntry());
+	entries.push_back(tiffShort(339, sampleType == GEOTIFF_INT32 ? 2 : sampleType == GEOTIFF_FLOAT32 ? 3 : 1));
+
+	if (geoTransform != NULL)
+	{
+		const double* gt = geoTransform;
+		if (gt[2] == 0.0 && gt[4] == 0.0)
+		{
+			double scale[3] = { gt[1], -gt[5], 0.0 };
+			double tiePoint[6] = { 0.0, 0.0, 0.0, gt[0], gt[3], 0.0 };
+			entries.push_back(tiffEntry(33550, TIFF_DOUBLE, scale, 3));
+			entries.push_back(tiffEntry(33922, TIFF_DOUBLE, tiePoint, 6));
+		}
+		else
+		{
+			double transform[16] = { gt[1], gt[2], 0.0, gt[0], gt[4], gt[5], 0.0, gt[3], 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 };
+			entries.push_back(tiffEntry(34264, TIFF_DOUBLE, transform, 16));
+		}
+
+		//GeoKeyDirectory: model type, pixel is area, coordinate system
+		bool geographic = epsg >= 4000 && epsg < 5000;
+		std::vector<unsigned short> keys;
+		unsigned short keyHeader[4] = { 1, 1, 0, 0 };
+		unsigned short modelType[4] = { 1024, 0, 1, (unsigned short) (geographic ? 2 : 1) };
+		unsigned short rasterType[4] = { 1025, 0, 1, 1 };
+		unsigned short system[4] = { (unsigned short) (geographic ? 2048 : 3072), 0, 1, (unsigned short) epsg };
+		keys.insert(keys.end(), keyHeader, keyHeader + 4);
+		keys.insert(keys.end(), modelType, modelType + 4);
+		keys.insert(keys.end(), rasterType, rasterType + 4);
+		if (epsg != 0)
+		{
+			keys.insert(keys.end(), system, system + 4);
+		}
+		keys[3] = (unsigned short) (keys.size() / 4 - 1);
+		entries.push_back(tiffEntry(34735, TIFF_SHORT, &keys[0], (int) keys.size()));
+	}
+
+	//The header's size depends only on the offset width, so lay it out to size it, then again
+	//with the real tile offsets
+	std::vector<unsigned char> header;
+	std::vector<unsigned long long> offsets(tileCount);
+	tiffLayout(entries, tileOffsetsEntry, offsets, byteCounts, false, header);
+	bool big = header.size() + tileBytes > TIFF_CLASSIC_LIMIT;
+	tiffLayout(entries, tileOffsetsEntry, offsets, byteCounts, big, header);
+	unsigned long long offset = header.size();
+	for (int t = 0; t < tileCount; t++)
+	{
+		offsets[t] = offset;
+		offset += byteCounts[t];
+	}
+	tiffLayout(entries, tileOffsetsEntry, offsets, byteCounts, big, header);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char*) &header[0], header.size());
+	for (int t = 0; t < tileCount; t++)
+	{
+		file.write((const char*) &tiles[t][0], tiles[t].size());
+	}
+	file.close();
+
+	return file.fail() ? VIEWSHED_IO_ERROR : VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingWriteGeoTiff(const char* path, const void* raster, int rasterWidth, int rasterHeight, int sampleType,
+	const double* geoTransform, int epsg, int tileSize)
+{
+	return calcWriteGeoTiff(path, raster, rasterWidth, rasterHeight, sampleType, geoTransform, epsg, tileSize);
+}
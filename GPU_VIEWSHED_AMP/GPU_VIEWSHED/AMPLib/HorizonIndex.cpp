@@ -0,0 +1,595 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <concrt.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+
+
+#define INDEX_MAGIC "VSHX"
+#define INDEX_VERSION 3
+
+//Rows built between checkpoints
+#define INDEX_CHUNK_ROWS 64
+
+#define INDEX_HALF_PI 1.5707963f
+
+//Largest ratio between neighbouring band edges, a quarter octave
+#define INDEX_BAND_RATIO 1.1892071f
+
+
+
+using namespace concurrency;
+
+
+//Horizon profile index: constant time approximate visibility from precomputed horizons
+//
+//For every cell, as an observer observerHeight above the ground, and for each of sectorCount
+//azimuths, a ray is marched out to maxRadius cells. The horizon elevation angle is recorded at
+//distance band edges, see bandEdges: every cell out to 11, then edges at most INDEX_BAND_RATIO
+//apart, about 4 log2(maxRadius) bands in all. Entry b holds the highest angle of terrain closer
+//than edge b. Angles are quantised to one byte over [-pi/2, pi/2].
+//
+//A target at distance d is called visible when its elevation angle is at least the entry for the
+//first edge at or past d, in the sector nearest its direction. Sources of error in an answer:
+//  - the horizon was measured along the sector centre, up to pi / sectorCount off the target,
+//    which can go either way
+//  - angles are quantised to within pi / 510 radians, either way
+//  - the entry takes in all terrain closer than the target and may take in some past it, from d
+//    out to less than INDEX_BAND_RATIO * d (none within 11 cells). This error is one sided: it can
+//    only hide a visible target, behind terrain less than 19% farther out than the target, and
+//    never shows a hidden one.
+//Targets beyond maxRadius are reported not visible.
+//
+//File layout: header, heights (float per cell), then blocks of INDEX_CHUNK_ROWS rows of
+//horizons, each an int byte count followed by the block's sectorCount * bandCount entries per
+//cell, compressed. A sector's entries never decrease outward and neighbouring sectors see much
+//the same ridges, so each entry is stored as its difference from a prediction out of the band
+//before and the sector before, see predictHorizon, in a nibble code with zero runs.
+//The build writes a block at a time and records the finished row count and where the blocks
+//end in the header, so an interrupted build resumes where it stopped. The header also holds a
+//hash of the DEM, and a build over a different DEM starts again rather than resuming.
+
+
+struct HorizonIndexHeader
+{
+	char magic[4];
+	int version;
+	int width;
+	int height;
+	int sectorCount;
+	int bandCount;
+	int maxRadius;
+	float observerHeight;
+	float cellSize;
+	int completedRows;
+	unsigned long long demHash;
+	long long horizonsEnd;
+};
+
+
+struct HorizonIndex
+{
+	HorizonIndexHeader header;
+	std::vector<float> heights;
+	std::vector<unsigned char> horizons;
+	std::vector<int> edges;
+};
+
+
+//Loaded indexes, the handle is the slot number
+static std::vector<std::shared_ptr<HorizonIndex> > loadedIndexes;
+static critical_section loadedIndexesLock;
+
+
+inline unsigned char quantiseAngle(float angle)
+{
+	float q = (angle + INDEX_HALF_PI) * (255.0f / (2 * INDEX_HALF_PI)) + 0.5f;
+	return (unsigned char) max(0.0f, min(255.0f, q));
+}
+
+
+inline float dequantiseAngle(unsigned char q)
+{
+	return q * (2 * INDEX_HALF_PI / 255.0f) - INDEX_HALF_PI;
+}
+
+
+//Band edges in cells out to the first at or past maxRadius. Each is the one before times
+//INDEX_BAND_RATIO rounded down, or one more where that doesn't move it.
+std::vector<int> bandEdges(int maxRadius)
+{
+	std::vector<int> edges(1, 1);
+	while (edges.back() < maxRadius)
+	{
+		int edge = edges.back();
+		edges.push_back(max(edge + 1, (int) (edge * INDEX_BAND_RATIO)));
+	}
+	return edges;
+}
+
+
+//Entry i of a block predicted from the band before and the same bands of the sector before,
+//the two neighbours horizons are most alike
+inline unsigned char predictHorizon(const unsigned char* horizons, size_t i, int sectorCount, int bandCount)
+{
+	int b = (int) (i % bandCount);
+	int s = (int) (i / bandCount % sectorCount);
+	int previousBand = b > 0 ? horizons[i - 1] : 0;
+	int previousSector = s > 0 ? horizons[i - bandCount] - (b > 0 ? horizons[i - bandCount - 1] : 0) : 0;
+	return (unsigned char) (previousBand + previousSector);
+}
+
+
+inline void putNibble(std::vector<unsigned char> &out, int &nibbles, int v)
+{
+	if ((nibbles++ & 1) == 0)
+	{
+		out.push_back((unsigned char) v);
+	}
+	else
+	{
+		out.back() |= (unsigned char) (v << 4);
+	}
+}
+
+
+//Append count horizon entries, cells of sectorCount * bandCount, coded as their differences from
+//predictHorizon in nibbles: 0 then n - 1 for a run of n zero differences (up to 16), 1 to 14 for
+//a small difference zigzagged (1 = -1, 2 = 1, 3 = -2 ...), or 15 then the difference byte
+void encodeHorizons(const unsigned char* horizons, size_t count, int sectorCount, int bandCount, std::vector<unsigned char> &out)
+{
+	int nibbles = 0;
+	int zeros = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned char delta = (unsigned char) (horizons[i] - predictHorizon(horizons, i, sectorCount, bandCount));
+		if (delta == 0 && zeros < 16)
+		{
+			zeros++;
+			continue;
+		}
+		if (zeros > 0)
+		{
+			putNibble(out, nibbles, 0);
+			putNibble(out, nibbles, zeros - 1);
+			zeros = 0;
+		}
+		if (delta == 0)
+		{
+			zeros = 1;
+			continue;
+		}
+
+		int signedDelta = (signed char) delta;
+		int zigzag = signedDelta >= 0 ? 2 * signedDelta : -2 * signedDelta - 1;
+		if (zigzag < 15)
+		{
+			putNibble(out, nibbles, zigzag);
+		}
+		else
+		{
+			putNibble(out, nibbles, 15);
+			putNibble(out, nibbles, delta & 15);
+			putNibble(out, nibbles, delta >> 4);
+		}
+	}
+	if (zeros > 0)
+	{
+		putNibble(out, nibbles, 0);
+		putNibble(out, nibbles, zeros - 1);
+	}
+}
+
+
+inline int nibbleAt(const unsigned char* in, size_t nibble)
+{
+	return (in[nibble >> 1] >> (4 * (nibble & 1))) & 15;
+}
+
+
+//Undo encodeHorizons into count entries, false if the data doesn't decode to exactly that many
+bool decodeHorizons(const unsigned char* in, size_t inBytes, unsigned char* horizons, size_t count,
+	int sectorCount, int bandCount)
+{
+	size_t nibble = 0;
+	size_t nibbleCount = 2 * inBytes;
+	size_t i = 0;
+
+	while (i < count)
+	{
+		if (nibble == nibbleCount)
+		{
+			return false;
+		}
+		int code = nibbleAt(in, nibble++);
+
+		int run = 1;
+		unsigned char delta = 0;
+		if (code == 0)
+		{
+			if (nibble + 1 > nibbleCount)
+			{
+				return false;
+			}
+			run = nibbleAt(in, nibble++) + 1;
+		}
+		else if (code == 15)
+		{
+			if (nibble + 2 > nibbleCount)
+			{
+				return false;
+			}
+			delta = (unsigned char) (nibbleAt(in, nibble) | nibbleAt(in, nibble + 1) << 4);
+			nibble += 2;
+		}
+		else
+		{
+			delta = (unsigned char) ((code & 1) ? -(code + 1) / 2 : code / 2);
+		}
+
+		if (i + run > count)
+		{
+			return false;
+		}
+		for (; run > 0; run--, i++)
+		{
+			horizons[i] = (unsigned char) (predictHorizon(horizons, i, sectorCount, bandCount) + delta);
+		}
+	}
+
+	//at most the padding half of the last byte is left
+	return nibbleCount - nibble <= 1;
+}
+
+
+//Horizon entries of one observer cell for every sector
+void buildCell(const float* zArray, const HorizonIndexHeader &h, const int* edges, int currX, int currY, unsigned char* out)
+{
+	float zObs = zArray[currY * h.width + currX] + h.observerHeight;
+
+	for (int s = 0; s < h.sectorCount; s++)
+	{
+		float theta = 4 * INDEX_HALF_PI * s / h.sectorCount;
+		float dirX = cos(theta);
+		float dirY = sin(theta);
+
+		unsigned char* bands = out + s * h.bandCount;
+
+		//highest tangent so far, nothing is closer than one cell
+		float highest = -1e30f;
+		bands[0] = quantiseAngle(-INDEX_HALF_PI);
+		int nextBand = 1;
+
+		for (int t = 1; t <= h.maxRadius; t++)
+		{
+			while (nextBand < h.bandCount && t >= edges[nextBand])
+			{
+				bands[nextBand++] = quantiseAngle(atan(highest));
+			}
+
+			int x = (int) floor(currX + t * dirX + 0.5f);
+			int y = (int) floor(currY + t * dirY + 0.5f);
+			if (x < 0 || x >= h.width || y < 0 || y >= h.height)
+			{
+				break;
+			}
+
+			float slope = (zArray[y * h.width + x] - zObs) / (t * h.cellSize);
+			if (slope > highest)
+			{
+				highest = slope;
+			}
+		}
+
+		while (nextBand < h.bandCount)
+		{
+			bands[nextBand++] = quantiseAngle(atan(highest));
+		}
+	}
+}
+
+
+//Build, or resume building, the index file at indexPath
+int calcBuildHorizonIndex(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float cellSize,
+	int sectorCount, int maxRadius, const char* indexPath)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0 || sectorCount <= 0 || maxRadius <= 0 || cellSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	HorizonIndexHeader h;
+	memcpy(h.magic, INDEX_MAGIC, 4);
+	h.version = INDEX_VERSION;
+	h.width = rasterWidth;
+	h.height = rasterHeight;
+	h.sectorCount = sectorCount;
+	std::vector<int> edges = bandEdges(maxRadius);
+	h.bandCount = (int) edges.size();
+	h.maxRadius = maxRadius;
+	h.observerHeight = observerHeight;
+	h.cellSize = cellSize;
+	h.completedRows = 0;
+	h.demHash = demContentHash(zArray, rasterWidth * rasterHeight);
+	h.horizonsEnd = sizeof(HorizonIndexHeader) + (long long) rasterWidth * rasterHeight * sizeof(float);
+
+	int cellBytes = sectorCount * h.bandCount;
+
+	//Pick up a checkpoint left by an earlier build over the same DEM with the same parameters
+	HorizonIndexHeader existing;
+	std::ifstream previous(indexPath, std::ios::binary);
+	bool resume = previous.read((char*) &existing, sizeof(existing)) && memcmp(existing.magic, h.magic, 4) == 0
+		&& existing.version == h.version && existing.width == h.width && existing.height == h.height
+		&& existing.sectorCount == h.sectorCount && existing.maxRadius == h.maxRadius
+		&& existing.observerHeight == h.observerHeight && existing.cellSize == h.cellSize
+		&& existing.demHash == h.demHash;
+	previous.close();
+
+	std::fstream file;
+	if (resume)
+	{
+		h.completedRows = existing.completedRows;
+		h.horizonsEnd = existing.horizonsEnd;
+		file.open(indexPath, std::ios::binary | std::ios::in | std::ios::out);
+	}
+	else
+	{
+		file.open(indexPath, std::ios::binary | std::ios::out | std::ios::trunc);
+		file.write((const char*) &h, sizeof(h));
+		file.write((const char*) zArray, (std::streamsize) rasterWidth * rasterHeight * sizeof(float));
+	}
+
+	if (!file)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	std::vector<unsigned char> chunk((size_t) INDEX_CHUNK_ROWS * rasterWidth * cellBytes);
+	std::vector<unsigned char> encoded;
+
+	while (h.completedRows < rasterHeight)
+	{
+		int firstRow = h.completedRows;
+		int rows = min(INDEX_CHUNK_ROWS, rasterHeight - firstRow);
+
+		parallel_for(0, rows * rasterWidth, [&](int i)
+		{
+			buildCell(zArray, h, &edges[0], i % rasterWidth, firstRow + i / rasterWidth, &chunk[(size_t) i * cellBytes]);
+		});
+
+		encoded.clear();
+		encodeHorizons(&chunk[0], (size_t) rows * rasterWidth * cellBytes, h.sectorCount, h.bandCount, encoded);
+		int encodedBytes = (int) encoded.size();
+
+		//over anything a build stopped after its last checkpoint left behind
+		file.seekp((std::streamoff) h.horizonsEnd);
+		file.write((const char*) &encodedBytes, sizeof(encodedBytes));
+		file.write((const char*) &encoded[0], encodedBytes);
+
+		//checkpoint
+		h.completedRows = firstRow + rows;
+		h.horizonsEnd += sizeof(encodedBytes) + encodedBytes;
+		file.seekp(0);
+		file.write((const char*) &h, sizeof(h));
+		file.flush();
+
+		if (!file)
+		{
+			return VIEWSHED_IO_ERROR;
+		}
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+//Load a finished index, returns a handle for the query calls or a negative status
+int calcLoadHorizonIndex(const char* indexPath)
+{
+	std::ifstream file(indexPath, std::ios::binary);
+	std::shared_ptr<HorizonIndex> index(new HorizonIndex());
+
+	if (!file.read((char*) &index->header, sizeof(HorizonIndexHeader)) || memcmp(index->header.magic, INDEX_MAGIC, 4) != 0
+		|| index->header.version != INDEX_VERSION || index->header.completedRows != index->header.height
+		|| index->header.maxRadius <= 0)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	const HorizonIndexHeader &h = index->header;
+	index->edges = bandEdges(h.maxRadius);
+	if ((int) index->edges.size() != h.bandCount)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+	size_t rowBytes = (size_t) h.width * h.sectorCount * h.bandCount;
+	index->heights.resize((size_t) h.width * h.height);
+	index->horizons.resize(rowBytes * h.height);
+	file.read((char*) &index->heights[0], (std::streamsize) index->heights.size() * sizeof(float));
+
+	std::vector<unsigned char> encoded;
+	for (int firstRow = 0; file && firstRow < h.height; firstRow += INDEX_CHUNK_ROWS)
+	{
+		int rows = min(INDEX_CHUNK_ROWS, h.height - firstRow);
+		int encodedBytes = 0;
+		file.read((char*) &encodedBytes, sizeof(encodedBytes));
+
+		//no entry takes more than three nibbles
+		if (!file || encodedBytes <= 0 || (size_t) encodedBytes > (3 * rows * rowBytes + 1) / 2)
+		{
+			return VIEWSHED_IO_ERROR;
+		}
+		encoded.resize(encodedBytes);
+		if (!file.read((char*) &encoded[0], encodedBytes)
+			|| !decodeHorizons(&encoded[0], encodedBytes, &index->horizons[firstRow * rowBytes], rows * rowBytes,
+			h.sectorCount, h.bandCount))
+		{
+			return VIEWSHED_IO_ERROR;
+		}
+	}
+
+	if (!file)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+
+	critical_section::scoped_lock lock(loadedIndexesLock);
+	for (int i = 0; i < (int) loadedIndexes.size(); i++)
+	{
+		if (!loadedIndexes[i])
+		{
+			loadedIndexes[i] = index;
+			return i;
+		}
+	}
+	loadedIndexes.push_back(index);
+	return (int) loadedIndexes.size() - 1;
+}
+
+
+//A reference to a loaded index, empty for a bad handle. Held for as long as the index is used.
+std::shared_ptr<HorizonIndex> findHorizonIndex(int handle)
+{
+	critical_section::scoped_lock lock(loadedIndexesLock);
+	if (handle < 0 || handle >= (int) loadedIndexes.size())
+	{
+		return std::shared_ptr<HorizonIndex>();
+	}
+	return loadedIndexes[handle];
+}
+
+
+//One observer/target answer from the index
+bool indexVisible(const HorizonIndex &index, int currX, int currY, int targetX, int targetY, float targetHeight)
+{
+	const HorizonIndexHeader &h = index.header;
+	int dx = targetX - currX;
+	int dy = targetY - currY;
+
+	if (dx == 0 && dy == 0)
+	{
+		return true;
+	}
+
+	float dist = (float) sqrt(cellDistSq(dx, dy));
+	if (dist > h.maxRadius)
+	{
+		return false;
+	}
+
+	int sector = (int) floor(atan2((float) dy, (float) dx) / (4 * INDEX_HALF_PI) * h.sectorCount + 0.5f);
+	sector = ((sector % h.sectorCount) + h.sectorCount) % h.sectorCount;
+
+	//first edge at or past the target, so every cell closer than it is counted
+	int band = (int) (std::lower_bound(index.edges.begin(), index.edges.end(), dist) - index.edges.begin());
+	band = min(h.bandCount - 1, band);
+
+	float zObs = index.heights[currY * h.width + currX] + h.observerHeight;
+	float zTarget = index.heights[targetY * h.width + targetX] + targetHeight;
+	float angle = atan((zTarget - zObs) / (dist * h.cellSize));
+
+	unsigned char horizon = index.horizons[((size_t) (currY * h.width + currX) * h.sectorCount + sector) * h.bandCount + band];
+	return angle >= dequantiseAngle(horizon);
+}
+
+
+int calcQueryHorizonIndex(int handle, int* observerX, int* observerY, int* targetX, int* targetY, float* targetHeight,
+	int queryCount, int* visibleArray)
+{
+	std::shared_ptr<HorizonIndex> index = findHorizonIndex(handle);
+	if (!index)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	const HorizonIndexHeader &h = index->header;
+	for (int i = 0; i < queryCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= h.width || observerY[i] < 0 || observerY[i] >= h.height
+			|| targetX[i] < 0 || targetX[i] >= h.width || targetY[i] < 0 || targetY[i] >= h.height)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+		visibleArray[i] = indexVisible(*index, observerX[i], observerY[i], targetX[i], targetY[i], targetHeight[i]) ? 1 : 0;
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+//Approximate viewshed of one observer, visibleArray is width x height of the indexed DEM
+int calcHorizonIndexViewshed(int handle, int currX, int currY, float targetHeight, int* visibleArray)
+{
+	std::shared_ptr<HorizonIndex> index = findHorizonIndex(handle);
+	if (!index || currX < 0 || currX >= index->header.width || currY < 0 || currY >= index->header.height)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	int width = index->header.width;
+	parallel_for(0, index->header.height, [&](int y)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			visibleArray[y * width + x] = indexVisible(*index, currX, currY, x, y, targetHeight) ? 1 : 0;
+		}
+	});
+
+	return VIEWSHED_OK;
+}
+
+
+int calcFreeHorizonIndex(int handle)
+{
+	critical_section::scoped_lock lock(loadedIndexesLock);
+	if (handle < 0 || handle >= (int) loadedIndexes.size() || !loadedIndexes[handle])
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	//queries still holding the index keep it until they finish
+	loadedIndexes[handle].reset();
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingBuildHorizonIndex(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float cellSize,
+	int sectorCount, int maxRadius, const char* indexPath)
+{
+	return calcBuildHorizonIndex(zArray, rasterWidth, rasterHeight, observerHeight, cellSize, sectorCount, maxRadius, indexPath);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingLoadHorizonIndex(const char* indexPath)
+{
+	return calcLoadHorizonIndex(indexPath);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingQueryHorizonIndex(int handle, int* observerX, int* observerY, int* targetX, int* targetY, float* targetHeight,
+	int queryCount, int* visibleArray)
+{
+	return calcQueryHorizonIndex(handle, observerX, observerY, targetX, targetY, targetHeight, queryCount, visibleArray);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingHorizonIndexViewshed(int handle, int currX, int currY, float targetHeight, int* visibleArray)
+{
+	return calcHorizonIndexViewshed(handle, currX, currY, targetHeight, visibleArray);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingFreeHorizonIndex(int handle)
+{
+	return calcFreeHorizonIndex(handle);
+}
@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include "amp.h"
+#include <concrt.h>
+#include <vector>
+#include <memory>
+#include <cstring>
+
+
+
+using namespace concurrency;
+
+
+//Layered DEM: bare earth kept resident on the accelerator, with obstructions and target heights
+//supplied per run and combined with it during traversal
+//
+//The DEM is uploaded once when the handle is opened. Each run may add an obstruction layer of
+//one byte per cell, scaled by obstructionScale metres (buildings, vegetation), and a target
+//height layer of one float per cell, metres above the obstructed surface. Neither is merged
+//into a copy of the DEM, so scenarios can be swapped by passing different layers to the same
+//handle. Obstructions block lines of sight; a cell is visible if its target, the surface plus
+//its target height, is at or above the horizon in front of it. Rays are the exact DDA ones, so
+//with neither layer the result matches DDA_EXACT.
+//Handles are reference counted, so closing one while a viewshed is running on it only drops
+//the registry's reference and the resident DEM goes when the viewshed finishes.
+
+
+struct LayeredDem
+{
+	int width;
+	int height;
+	std::unique_ptr<array<float, 2> > zResident;
+};
+
+
+//Open layered DEMs, the handle is the slot number
+static std::vector<std::shared_ptr<LayeredDem> > layeredDems;
+static critical_section layeredDemsLock;
+
+
+int calcOpenLayeredDem(float* zArray, int rasterWidth, int rasterHeight)
+{
+	if (zArray == NULL || rasterWidth <= 0 || rasterHeight <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	accelerator_view av = exactAccelerator().default_view;
+
+	std::shared_ptr<LayeredDem> dem(new LayeredDem());
+	dem->width = rasterWidth;
+	dem->height = rasterHeight;
+	dem->zResident.reset(new array<float, 2>(rasterHeight, rasterWidth, zArray, zArray + rasterWidth * rasterHeight, av));
+
+	critical_section::scoped_lock lock(layeredDemsLock);
+	for (int i = 0; i < (int) layeredDems.size(); i++)
+	{
+		if (!layeredDems[i])
+		{
+			layeredDems[i] = dem;
+			return i;
+		}
+	}
+	layeredDems.push_back(dem);
+	return (int) layeredDems.size() - 1;
+}
+
+
+//A reference to an open layered DEM, empty for a bad handle. Held for as long as the DEM is used.
+std::shared_ptr<LayeredDem> findLayeredDem(int handle)
+{
+	critical_section::scoped_lock lock(layeredDemsLock);
+	if (handle < 0 || handle >= (int) layeredDems.size())
+	{
+		return std::shared_ptr<LayeredDem>();
+	}
+	return layeredDems[handle];
+}
+
+
+//Obstruction of cell i in metres, the bytes are packed four to a word, lowest address first
+//Scaled in float, the caller widens the result; only float to double conversions are used
+inline float obstructionAt(const array_view<const unsigned int, 1> &dataViewObstruction, int i, float obstructionScale) restrict(amp)
+{
+	int byte = (int) ((dataViewObstruction[i >> 2] >> ((i & 3) * 8)) & 0xFF);
+	return (float) byte * obstructionScale;
+}
+
+
+//traceRayExact over the DEM plus obstructions, testing each cell's target against the horizon
+//before the cell's own surface raises it
+void traceRayLayered(const array_view<const float, 2> &dataViewZ, const array_view<const unsigned int, 1> &dataViewObstruction,
+	const array_view<const float, 2> &dataViewTarget, const array_view<int, 2> &dataViewVisible,
+	int useObstruction, float obstructionScale, int useTarget, int rasterWidth,
+	int currX, int currY, int currZ, int destX, int destY) restrict(amp)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(direct3d::abs(dx), direct3d::abs(dy));
+
+	//previously highest LOS, a distance of 0 means nothing has been seen yet
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double surfaceZ = (double) dataViewZ(y, x) - currZ;
+		if (useObstruction)
+		{
+			surfaceZ += (double) obstructionAt(dataViewObstruction, y * rasterWidth + x, obstructionScale);
+		}
+		double targetZ = useTarget ? surfaceZ + dataViewTarget(y, x) : surfaceZ;
+
+		if (highestDistSq == 0 || slopeAtLeast(targetZ, distSq, highestZ, highestDistSq))
+		{
+			dataViewVisible(y, x) = 1;
+		}
+		if (highestDistSq == 0 || slopeAtLeast(surfaceZ, distSq, highestZ, highestDistSq))
+		{
+			highestZ = surfaceZ;
+			highestDistSq = distSq;
+		}
+	}
+}
+
+
+//Viewshed of one observer over a layered DEM. obstructionArray (bytes) and targetHeightArray
+//(floats) are rasterWidth x rasterHeight like the DEM, either may be null. visibleArray is
+//cleared and filled with 1 for visible cells.
+int calcLayeredViewshed(int handle, int currX, int currY, int currZ, unsigned char* obstructionArray, float obstructionScale,
+	float* targetHeightArray, int* visibleArray)
+{
+	std::shared_ptr<LayeredDem> dem = findLayeredDem(handle);
+	if (!dem || visibleArray == NULL)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	int rasterWidth = dem->width;
+	int rasterHeight = dem->height;
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	TraceScope trace("layered viewshed", handle);
+
+	accelerator_view av = exactAccelerator().default_view;
+	int cells = rasterWidth * rasterHeight;
+
+	//The kernel reads the bytes as words; copy them only if the caller's layer can't be read that way
+	int useObstruction = obstructionArray != NULL ? 1 : 0;
+	std::vector<unsigned int> obstructionWords(1);
+	const unsigned int* obstructionData = obstructionWords.data();
+	int obstructionLength = 1;
+	if (useObstruction)
+	{
+		obstructionLength = (cells + 3) / 4;
+		if ((cells & 3) == 0 && ((size_t) obstructionArray & 3) == 0)
+		{
+			obstructionData = (const unsigned int*) obstructionArray;
+		}
+		else
+		{
+			obstructionWords.assign(obstructionLength, 0);
+			memcpy(obstructionWords.data(), obstructionArray, cells);
+			obstructionData = obstructionWords.data();
+		}
+	}
+
+	float noTarget = 0.0f;
+	int useTarget = targetHeightArray != NULL ? 1 : 0;
+
+	const array_view<const float, 2> dataViewZ(*dem->zResident);
+	const array_view<const unsigned int, 1> dataViewObstruction(obstructionLength, obstructionData);
+	const array_view<const float, 2> dataViewTarget(useTarget ? rasterHeight : 1, useTarget ? rasterWidth : 1,
+		useTarget ? targetHeightArray : &noTarget);
+	array_view<int, 2> dataViewVisible(rasterHeight, rasterWidth, visibleArray);
+	dataViewVisible.discard_data();
+
+	parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewVisible[idx] = (idx[0] == currY && idx[1] == currX) ? 1 : 0;
+	});
+
+	extent<1> eY(rasterHeight);
+	extent<1> eX(rasterWidth);
+
+	//West and East edges
+	parallel_for_each(av, eY, [=](index<1> idx) restrict(amp)
+	{
+		traceRayLayered(dataViewZ, dataViewObstruction, dataViewTarget, dataViewVisible, useObstruction, obstructionScale,
+			useTarget, rasterWidth, currX, currY, currZ, 0, idx[0]);
+		traceRayLayered(dataViewZ, dataViewObstruction, dataViewTarget, dataViewVisible, useObstruction, obstructionScale,
+			useTarget, rasterWidth, currX, currY, currZ, rasterWidth - 1, idx[0]);
+	});
+
+	//South and North edges
+	parallel_for_each(av, eX, [=](index<1> idx) restrict(amp)
+	{
+		traceRayLayered(dataViewZ, dataViewObstruction, dataViewTarget, dataViewVisible, useObstruction, obstructionScale,
+			useTarget, rasterWidth, currX, currY, currZ, idx[0], 0);
+		traceRayLayered(dataViewZ, dataViewObstruction, dataViewTarget, dataViewVisible, useObstruction, obstructionScale,
+			useTarget, rasterWidth, currX, currY, currZ, idx[0], rasterHeight - 1);
+	});
+
+	dataViewVisible.synchronize();
+	return VIEWSHED_OK;
+}
+
+
+int calcCloseLayeredDem(int handle)
+{
+	critical_section::scoped_lock lock(layeredDemsLock);
+	if (handle < 0 || handle >= (int) layeredDems.size() || !layeredDems[handle])
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	//a viewshed still holding the DEM keeps it until it finishes
+	layeredDems[handle].reset();
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingOpenLayeredDem(float* zArray, int rasterWidth, int rasterHeight)
+{
+	return calcOpenLayeredDem(zArray, rasterWidth, rasterHeight);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingLayeredViewshed(int handle, int currX, int currY, int currZ, unsigned char* obstructionArray,
+	float obstructionScale, float* targetHeightArray, int* visibleArray)
+{
+	return calcLayeredViewshed(handle, currX, currY, currZ, obstructionArray, obstructionScale, targetHeightArray, visibleArray);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingCloseLayeredDem(int handle)
+{
+	return calcCloseLayeredDem(handle);
+}
@@ -0,0 +1,135 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+
+
+
+using namespace concurrency;
+
+
+//Point to point line of sight for batches of observer/target pairs
+//
+//Each pair walks the same whole cell DDA steps as DDA_EXACT, comparing the terrain against the
+//height of the sight line at each step, so the inner loop is a multiply-add and a compare.
+//Pairs are processed in observer order so that neighbouring tasks read the same DEM rows.
+
+
+//Walk the line between observer and target, returns the smallest clearance of the sight line
+//above the terrain. With stopAtObstruction set the walk ends at the first blocking cell.
+float clearanceAlongLine(const float* zArray, int rasterWidth, int obsX, int obsY, float obsZ,
+	int tgtX, int tgtY, float tgtZ, bool stopAtObstruction)
+{
+	int dx = tgtX - obsX;
+	int dy = tgtY - obsY;
+	int steps = max(abs(dx), abs(dy));
+
+	float clearance = FLT_MAX;
+	if (steps == 0)
+	{
+		return clearance;
+	}
+	float rise = (tgtZ - obsZ) / steps;
+
+	RayStepper ray(dx, dy, steps);
+
+	//both end points are excluded, only the cells in between can block
+	for (int k = 1; k < steps; k++)
+	{
+		ray.next();
+		int x = obsX + ray.x;
+		int y = obsY + ray.y;
+
+		float margin = obsZ + rise * k - zArray[y * rasterWidth + x];
+
+		if (margin < clearance)
+		{
+			clearance = margin;
+			if (stopAtObstruction && clearance < 0)
+			{
+				break;
+			}
+		}
+	}
+
+	return clearance;
+}
+
+
+//Heights are above the ground. visibleArray receives 1 if the target can be seen and
+//clearanceArray the smallest gap between sight line and terrain (negative when blocked,
+//FLT_MAX for adjacent cells). With stopAtFirstObstruction set, a blocked pair reports the
+//clearance at its first obstruction instead of the minimum.
+//chunkSize pairs are handed to each task, large enough to amortise scheduling.
+int calcLineOfSight(float* zArray, int rasterWidth, int rasterHeight,
+	int* observerX, int* observerY, float* observerHeight, int* targetX, int* targetY, float* targetHeight,
+	int pairCount, int stopAtFirstObstruction, int chunkSize, int* visibleArray, float* clearanceArray)
+{
+	if (chunkSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	for (int i = 0; i < pairCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight
+			|| targetX[i] < 0 || targetX[i] >= rasterWidth || targetY[i] < 0 || targetY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	//Visit the pairs grouped by observer cell, then by target cell
+	std::vector<int> order(pairCount);
+	for (int i = 0; i < pairCount; i++)
+	{
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		int observerA = observerY[a] * rasterWidth + observerX[a];
+		int observerB = observerY[b] * rasterWidth + observerX[b];
+		if (observerA != observerB)
+		{
+			return observerA < observerB;
+		}
+		return targetY[a] * rasterWidth + targetX[a] < targetY[b] * rasterWidth + targetX[b];
+	});
+
+	bool stopAtObstruction = stopAtFirstObstruction != 0;
+	int chunkCount = (pairCount + chunkSize - 1) / chunkSize;
+
+	parallel_for(0, chunkCount, [&](int chunk)
+	{
+		int end = min(pairCount, (chunk + 1) * chunkSize);
+
+		for (int n = chunk * chunkSize; n < end; n++)
+		{
+			int i = order[n];
+			float obsZ = zArray[observerY[i] * rasterWidth + observerX[i]] + observerHeight[i];
+			float tgtZ = zArray[targetY[i] * rasterWidth + targetX[i]] + targetHeight[i];
+
+			float clearance = clearanceAlongLine(zArray, rasterWidth, observerX[i], observerY[i], obsZ,
+				targetX[i], targetY[i], tgtZ, stopAtObstruction);
+
+			visibleArray[i] = clearance >= 0 ? 1 : 0;
+			clearanceArray[i] = clearance;
+		}
+	});
+
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingLineOfSight(float* zArray, int rasterWidth, int rasterHeight,
+	int* observerX, int* observerY, float* observerHeight, int* targetX, int* targetY, float* targetHeight,
+	int pairCount, int stopAtFirstObstruction, int* visibleArray, float* clearanceArray)
+{
+	return calcLineOfSight(zArray, rasterWidth, rasterHeight, observerX, observerY, observerHeight,
+		targetX, targetY, targetHeight, pairCount, stopAtFirstObstruction, tuningProfile().losChunkSize, visibleArray, clearanceArray);
+}
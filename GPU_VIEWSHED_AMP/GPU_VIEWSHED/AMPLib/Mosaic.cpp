@@ -0,0 +1,389 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <concrt.h>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+
+//Height of mosaic cells no sheet covers, low enough never to block a line of sight
+#define MOSAIC_NODATA -32768.0f
+
+
+
+using namespace concurrency;
+
+
+//Tiled DEM mosaic: elevations read through an LRU cache of tiles over a set of DEM sheets
+//
+//Each sheet is a raw file of width x height floats, row by row, placed at originX, originY in a
+//grid shared by all sheets (same cell size, aligned). The mosaic covers their bounding box and
+//is cut into tileSize x tileSize tiles, decoded from whichever sheets overlap them on first use.
+//At most maxCachedTiles stay decoded; the least recently used is dropped to make room. Tiles
+//are reference counted, so a job still copying from an evicted tile keeps it alive, and so are
+//mosaics, so closing a handle while a viewshed or its prefetch is still running only drops the
+//registry's reference and the mosaic goes when the last job lets go of it.
+//
+//A viewshed is computed on the (2 * radius + 1) square window centred on the observer. The
+//window is filled tile ring by tile ring outward from the observer, the same order XDRAW's
+//rings reach them, with the next ring's tiles prefetched while the current one is copied.
+//The cache is shared, so concurrent jobs on one mosaic reuse each other's tiles.
+
+
+struct MosaicSheet
+{
+	std::string path;
+	int originX;
+	int originY;
+	int width;
+	int height;
+};
+
+
+struct CachedTile
+{
+	std::shared_ptr<std::vector<float> > heights;
+	std::list<long long>::iterator recent;
+};
+
+
+struct Mosaic
+{
+	std::vector<MosaicSheet> sheets;
+	int minX;
+	int minY;
+	int maxX;
+	int maxY;
+	int tileSize;
+	int tilesX;
+	int maxCachedTiles;
+
+	//front is the most recently used tile
+	std::list<long long> recentTiles;
+	std::map<long long, CachedTile> tiles;
+	critical_section tilesLock;
+};
+
+
+//Open mosaics, the handle is the slot number
+static std::vector<std::shared_ptr<Mosaic> > openMosaics;
+static critical_section openMosaicsLock;
+
+
+long long fileLength(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+	return file ? (long long) file.tellg() : -1;
+}
+
+
+int calcOpenMosaic(const char** sheetPaths, int* originX, int* originY, int* sheetWidth, int* sheetHeight, int sheetCount,
+	int tileSize, int maxCachedTiles)
+{
+	if (sheetCount <= 0 || tileSize <= 0 || maxCachedTiles <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	std::shared_ptr<Mosaic> mosaic(new Mosaic());
+	for (int i = 0; i < sheetCount; i++)
+	{
+		MosaicSheet sheet;
+		sheet.path = sheetPaths[i];
+		sheet.originX = originX[i];
+		sheet.originY = originY[i];
+		sheet.width = sheetWidth[i];
+		sheet.height = sheetHeight[i];
+
+		if (sheet.width <= 0 || sheet.height <= 0)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+		if (fileLength(sheet.path) != (long long) sheet.width * sheet.height * sizeof(float))
+		{
+			return VIEWSHED_IO_ERROR;
+		}
+		mosaic->sheets.push_back(sheet);
+	}
+
+	mosaic->minX = originX[0];
+	mosaic->minY = originY[0];
+	mosaic->maxX = originX[0] + sheetWidth[0];
+	mosaic->maxY = originY[0] + sheetHeight[0];
+	for (int i = 1; i < sheetCount; i++)
+	{
+		mosaic->minX = min(mosaic->minX, originX[i]);
+		mosaic->minY = min(mosaic->minY, originY[i]);
+		mosaic->maxX = max(mosaic->maxX, originX[i] + sheetWidth[i]);
+		mosaic->maxY = max(mosaic->maxY, originY[i] + sheetHeight[i]);
+	}
+	mosaic->tileSize = tileSize;
+	mosaic->tilesX = (mosaic->maxX - mosaic->minX + tileSize - 1) / tileSize;
+	mosaic->maxCachedTiles = maxCachedTiles;
+
+	critical_section::scoped_lock lock(openMosaicsLock);
+	for (int i = 0; i < (int) openMosaics.size(); i++)
+	{
+		if (!openMosaics[i])
+		{
+			openMosaics[i] = mosaic;
+			return i;
+		}
+	}
+	openMosaics.push_back(mosaic);
+	return (int) openMosaics.size() - 1;
+}
+
+
+//A reference to an open mosaic, empty for a bad handle. Held for as long as the mosaic is used.
+std::shared_ptr<Mosaic> findMosaic(int handle)
+{
+	critical_section::scoped_lock lock(openMosaicsLock);
+	if (handle < 0 || handle >= (int) openMosaics.size())
+	{
+		return std::shared_ptr<Mosaic>();
+	}
+	return openMosaics[handle];
+}
+
+
+//Heights of one tile from every sheet overlapping it, MOSAIC_NODATA elsewhere. Empty if a sheet
+//can't be opened or comes up short, say it was truncated after the mosaic was opened.
+std::shared_ptr<std::vector<float> > decodeTile(const Mosaic &mosaic, int tileX, int tileY)
+{
+	TraceScope trace("tile decode", tileY * mosaic.tilesX + tileX);
+	int size = mosaic.tileSize;
+	int x0 = mosaic.minX + tileX * size;
+	int y0 = mosaic.minY + tileY * size;
+	std::shared_ptr<std::vector<float> > heights(new std::vector<float>(size * size, MOSAIC_NODATA));
+
+	for (int s = 0; s < (int) mosaic.sheets.size(); s++)
+	{
+		const MosaicSheet &sheet = mosaic.sheets[s];
+		int left = max(x0, sheet.originX);
+		int right = min(x0 + size, sheet.originX + sheet.width);
+		int top = max(y0, sheet.originY);
+		int bottom = min(y0 + size, sheet.originY + sheet.height);
+		if (left >= right || top >= bottom)
+		{
+			continue;
+		}
+
+		std::ifstream file(sheet.path.c_str(), std::ios::binary);
+		if (!file)
+		{
+			return std::shared_ptr<std::vector<float> >();
+		}
+		for (int y = top; y < bottom; y++)
+		{
+			long long offset = ((long long) (y - sheet.originY) * sheet.width + (left - sheet.originX)) * sizeof(float);
+			file.seekg(offset);
+			if (!file.read((char*) &(*heights)[(y - y0) * size + (left - x0)], (right - left) * sizeof(float)))
+			{
+				return std::shared_ptr<std::vector<float> >();
+			}
+		}
+	}
+	return heights;
+}
+
+
+//A tile from the cache, decoded and inserted on a miss. Decoding happens outside the lock so
+//jobs only wait on each other for the bookkeeping; two jobs missing the same tile at once
+//both decode it and the first insert wins. Empty if the tile can't be read, which is not cached.
+std::shared_ptr<std::vector<float> > acquireTile(Mosaic &mosaic, int tileX, int tileY)
+{
+	long long key = (long long) tileY * mosaic.tilesX + tileX;
+	{
+		critical_section::scoped_lock lock(mosaic.tilesLock);
+		std::map<long long, CachedTile>::iterator found = mosaic.tiles.find(key);
+		if (found != mosaic.tiles.end())
+		{
+			mosaic.recentTiles.splice(mosaic.recentTiles.begin(), mosaic.recentTiles, found->second.recent);
+			return found->second.heights;
+		}
+	}
+
+	std::shared_ptr<std::vector<float> > heights = decodeTile(mosaic, tileX, tileY);
+	if (!heights)
+	{
+		return heights;
+	}
+
+	critical_section::scoped_lock lock(mosaic.tilesLock);
+	std::map<long long, CachedTile>::iterator found = mosaic.tiles.find(key);
+	if (found != mosaic.tiles.end())
+	{
+		return found->second.heights;
+	}
+	while ((int) mosaic.tiles.size() >= mosaic.maxCachedTiles)
+	{
+		mosaic.tiles.erase(mosaic.recentTiles.back());
+		mosaic.recentTiles.pop_back();
+	}
+	mosaic.recentTiles.push_front(key);
+	CachedTile tile;
+	tile.heights = heights;
+	tile.recent = mosaic.recentTiles.begin();
+	mosaic.tiles[key] = tile;
+	return heights;
+}
+
+
+//Viewshed of an observer at currX, currY in the sheets' grid, currZ absolute as for staging.
+//visibleArray is the (2 * radius + 1) square window centred on the observer, cells outside
+//every sheet are left not visible. VIEWSHED_IO_ERROR if a tile the window needs can't be read.
+int calcMosaicViewshed(int handle, int currX, int currY, int currZ, int radius, int gpuType, int* visibleArray, ViewshedJob* job)
+{
+	std::shared_ptr<Mosaic> mosaic = findMosaic(handle);
+	if (!mosaic || radius < 1 || currX < mosaic->minX || currX >= mosaic->maxX || currY < mosaic->minY || currY >= mosaic->maxY)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	int size = 2 * radius + 1;
+	int windowX = currX - radius;
+	int windowY = currY - radius;
+	std::vector<float> zArray(size * size, MOSAIC_NODATA);
+	std::vector<float> losArray(size * size);
+
+	//Tiles overlapping the window, clipped to the mosaic, grouped into rings round the observer's tile
+	int tileSize = mosaic->tileSize;
+	int firstTileX = (max(windowX, mosaic->minX) - mosaic->minX) / tileSize;
+	int firstTileY = (max(windowY, mosaic->minY) - mosaic->minY) / tileSize;
+	int lastTileX = (min(windowX + size, mosaic->maxX) - 1 - mosaic->minX) / tileSize;
+	int lastTileY = (min(windowY + size, mosaic->maxY) - 1 - mosaic->minY) / tileSize;
+	int centreTileX = (currX - mosaic->minX) / tileSize;
+	int centreTileY = (currY - mosaic->minY) / tileSize;
+
+	int ringCount = max(max(centreTileX - firstTileX, lastTileX - centreTileX), max(centreTileY - firstTileY, lastTileY - centreTileY)) + 1;
+	std::vector<std::vector<int> > rings(ringCount + 1);
+	for (int ty = firstTileY; ty <= lastTileY; ty++)
+	{
+		for (int tx = firstTileX; tx <= lastTileX; tx++)
+		{
+			int ring = max(abs(tx - centreTileX), abs(ty - centreTileY));
+			rings[ring].push_back(tx);
+			rings[ring].push_back(ty);
+		}
+	}
+
+	task_group prefetch;
+	volatile LONG readFailed = 0;
+	for (int ring = 0; ring < ringCount; ring++)
+	{
+		const std::vector<int> &next = rings[ring + 1];
+		for (int t = 0; t < (int) next.size(); t += 2)
+		{
+			int tx = next[t];
+			int ty = next[t + 1];
+			//holds its own reference, a failed read is retried and reported by the copy
+			prefetch.run([=]
+			{
+				acquireTile(*mosaic, tx, ty);
+			});
+		}
+
+		const std::vector<int> &current = rings[ring];
+		parallel_for(0, (int) current.size() / 2, [&](int t)
+		{
+			int tx = current[2 * t];
+			int ty = current[2 * t + 1];
+			std::shared_ptr<std::vector<float> > tile = acquireTile(*mosaic, tx, ty);
+			if (!tile)
+			{
+				InterlockedExchange(&readFailed, 1);
+				return;
+			}
+
+			int tileLeft = mosaic->minX + tx * tileSize;
+			int tileTop = mosaic->minY + ty * tileSize;
+			int left = max(tileLeft, windowX);
+			int right = min(tileLeft + tileSize, windowX + size);
+			int top = max(tileTop, windowY);
+			int bottom = min(tileTop + tileSize, windowY + size);
+			for (int y = top; y < bottom; y++)
+			{
+				memcpy(&zArray[(y - windowY) * size + (left - windowX)], &(*tile)[(y - tileTop) * tileSize + (left - tileLeft)],
+					(right - left) * sizeof(float));
+			}
+		});
+	}
+	prefetch.wait();
+
+	if (readFailed)
+	{
+		return VIEWSHED_IO_ERROR;
+	}
+	if (zArray[radius * size + radius] == MOSAIC_NODATA)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	if (gpuType == AUTO)
+	{
+		gpuType = tunedAlgorithm(size, size);
+	}
+	memset(visibleArray, 0, size * size * sizeof(int));
+	visibleArray[radius * size + radius] = 1;
+	if (gpuType == XDRAW)
+	{
+		seedXdraw(&zArray[0], visibleArray, &losArray[0], size, size, radius, radius, currZ);
+	}
+
+	int status = stagingJob(&zArray[0], size, size, visibleArray, size, size, radius, radius, currZ, size, size, &losArray[0],
+		gpuType, job);
+
+	for (int i = 0; i < size * size; i++)
+	{
+		if (zArray[i] == MOSAIC_NODATA)
+		{
+			visibleArray[i] = 0;
+		}
+	}
+	return status;
+}
+
+
+int calcCloseMosaic(int handle)
+{
+	critical_section::scoped_lock lock(openMosaicsLock);
+	if (handle < 0 || handle >= (int) openMosaics.size() || !openMosaics[handle])
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	//jobs still holding the mosaic keep it until they finish
+	openMosaics[handle].reset();
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingOpenMosaic(const char** sheetPaths, int* originX, int* originY, int* sheetWidth, int* sheetHeight,
+	int sheetCount, int tileSize, int maxCachedTiles)
+{
+	return calcOpenMosaic(sheetPaths, originX, originY, sheetWidth, sheetHeight, sheetCount, tileSize, maxCachedTiles);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingMosaicViewshed(int handle, int currX, int currY, int currZ, int radius, int gpuType, int* visibleArray,
+	ViewshedJob* job)
+{
+	return calcMosaicViewshed(handle, currX, currY, currZ, radius, gpuType, visibleArray, job);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingCloseMosaic(int handle)
+{
+	return calcCloseMosaic(handle);
+}
@@ -0,0 +1,447 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <thread>
+#include <cstring>
+
+
+//DEM placement across NUMA nodes
+#define NUMA_REPLICATE 1
+#define NUMA_INTERLEAVE 2
+
+//Interleaved DEMs alternate nodes every this many bytes, a whole number of pages
+#define NUMA_INTERLEAVE_BYTES (64 * 1024)
+
+//Memory streamed per node by the bandwidth probe, and the passes timed
+#define NUMA_BANDWIDTH_BYTES (256 * 1024 * 1024)
+#define NUMA_BANDWIDTH_PASSES 3
+
+
+
+using namespace concurrency;
+
+
+//NUMA aware CPU engine: cumulative exact viewshed with workers pinned to their node's processors
+//
+//Each node gets one worker thread per processor, pinned with its affinity mask. The DEM is
+//either replicated, one copy committed on each node, or interleaved, a single copy whose
+//NUMA_INTERLEAVE_BYTES chunks are committed on the nodes in turn. Counts are kept in one raster
+//per node, committed on that node and shared by its workers with interlocked increments, and
+//summed at the end. A worker only owns a one bit per cell mask of what its current observer has
+//seen, first touched by the worker itself so it lands on its node. Observers are queued on the
+//node nearest their data: round robin when replicated, the node holding the observer's chunk
+//when interleaved. Workers drain their own node's queue first, then help the others.
+//
+//Rays are the DDA_EXACT rays, traced on the CPU with the same slope test, so the counts match
+//calcDDAExact observer for observer. Only the first 64 processors of a node are used.
+
+
+struct NumaNode
+{
+	int node;
+	ULONGLONG mask;
+	int processors;
+};
+
+
+//Nodes with processors, or a single unpinned node when the system reports no NUMA
+std::vector<NumaNode> numaNodes()
+{
+	std::vector<NumaNode> nodes;
+	ULONG highest = 0;
+	if (GetNumaHighestNodeNumber(&highest))
+	{
+		for (ULONG n = 0; n <= highest; n++)
+		{
+			NumaNode node;
+			node.node = (int) n;
+			node.mask = 0;
+			node.processors = 0;
+			if (GetNumaNodeProcessorMask((UCHAR) n, &node.mask) && node.mask != 0)
+			{
+				for (int bit = 0; bit < 64; bit++)
+				{
+					node.processors += (node.mask >> bit) & 1;
+				}
+				nodes.push_back(node);
+			}
+		}
+	}
+	if (nodes.empty())
+	{
+		NumaNode node;
+		node.node = 0;
+		node.mask = 0;
+		node.processors = max(1, (int) std::thread::hardware_concurrency());
+		nodes.push_back(node);
+	}
+	return nodes;
+}
+
+
+//The processor'th set bit of mask, 0 for an unpinned node
+ULONGLONG processorMask(ULONGLONG mask, int processor)
+{
+	for (int bit = 0; bit < 64; bit++)
+	{
+		if ((mask >> bit) & 1)
+		{
+			if (processor-- == 0)
+			{
+				return 1ULL << bit;
+			}
+		}
+	}
+	return 0;
+}
+
+
+//Committed memory preferred on node
+void* allocateOnNode(size_t bytes, int node)
+{
+	return VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+}
+
+
+//One contiguous range with its chunks committed on the nodes in turn
+void* allocateInterleaved(size_t bytes, const std::vector<NumaNode> &nodes)
+{
+	char* base = (char*) VirtualAlloc(NULL, bytes, MEM_RESERVE, PAGE_READWRITE);
+	if (base == NULL)
+	{
+		return NULL;
+	}
+	for (size_t offset = 0, chunk = 0; offset < bytes; offset += NUMA_INTERLEAVE_BYTES, chunk++)
+	{
+		size_t length = min((size_t) NUMA_INTERLEAVE_BYTES, bytes - offset);
+		if (VirtualAllocExNuma(GetCurrentProcess(), base + offset, length, MEM_COMMIT, PAGE_READWRITE,
+			nodes[chunk % nodes.size()].node) == NULL)
+		{
+			VirtualFree(base, 0, MEM_RELEASE);
+			return NULL;
+		}
+	}
+	return base;
+}
+
+
+//traceRayExact on the CPU. A cell is counted once per observer: seen has a bit per cell, set
+//once the observer's count for it has been added.
+void traceRayCpu(const float* zArray, int rasterWidth, unsigned int* seen, volatile LONG* counts,
+	int currX, int currY, int currZ, int destX, int destY)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(abs(dx), abs(dy));
+
+	double highestZ = 0.0;
+	double highestDistSq = 0.0;
+
+	RayStepper ray(dx, dy, steps);
+	for (int k = 1; k <= steps; k++)
+	{
+		ray.next();
+		int x = currX + ray.x;
+		int y = currY + ray.y;
+
+		double distSq = cellDistSq(x - currX, y - currY);
+		double dz = (double) zArray[y * rasterWidth + x] - currZ;
+
+		if (highestDistSq == 0 || slopeAtLeast(dz, distSq, highestZ, highestDistSq))
+		{
+			int cell = y * rasterWidth + x;
+			if ((seen[cell >> 5] & (1u << (cell & 31))) == 0)
+			{
+				seen[cell >> 5] |= 1u << (cell & 31);
+				InterlockedIncrement(&counts[cell]);
+			}
+			highestZ = dz;
+			highestDistSq = distSq;
+		}
+	}
+}
+
+
+//cumulativeArray receives, for each cell, how many observers see it. placement is
+//NUMA_REPLICATE or NUMA_INTERLEAVE.
+int calcNumaViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int placement, int* cumulativeArray, ViewshedJob* job)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0 || observerCount <= 0
+		|| (placement != NUMA_REPLICATE && placement != NUMA_INTERLEAVE))
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	std::vector<NumaNode> nodes = numaNodes();
+	int nodeCount = (int) nodes.size();
+	int cells = rasterWidth * rasterHeight;
+	size_t demBytes = cells * sizeof(float);
+
+	//DEM copies, one per node when replicated, the single interleaved copy in slot 0 otherwise,
+	//and the counts of each node. Committed memory reads as zero, so the counts start cleared.
+	std::vector<float*> dems(nodeCount, (float*) NULL);
+	std::vector<volatile LONG*> nodeCounts(nodeCount, (volatile LONG*) NULL);
+	bool placed = true;
+	for (int n = 0; n < nodeCount; n++)
+	{
+		if (placement == NUMA_REPLICATE || n == 0)
+		{
+			dems[n] = placement == NUMA_REPLICATE ? (float*) allocateOnNode(demBytes, nodes[n].node)
+				: (float*) allocateInterleaved(demBytes, nodes);
+			placed = placed && dems[n] != NULL;
+		}
+		nodeCounts[n] = (volatile LONG*) allocateOnNode(cells * sizeof(LONG), nodes[n].node);
+		placed = placed && nodeCounts[n] != NULL;
+	}
+	if (!placed)
+	{
+		for (int n = 0; n < nodeCount; n++)
+		{
+			if (dems[n] != NULL)
+			{
+				VirtualFree(dems[n], 0, MEM_RELEASE);
+			}
+			if (nodeCounts[n] != NULL)
+			{
+				VirtualFree((void*) nodeCounts[n], 0, MEM_RELEASE);
+			}
+		}
+		return VIEWSHED_OUT_OF_MEMORY;
+	}
+	for (int n = 0; n < nodeCount; n++)
+	{
+		if (dems[n] != NULL)
+		{
+			memcpy(dems[n], zArray, demBytes);
+		}
+	}
+
+	//Observer queues by node
+	std::vector<std::vector<int> > queues(nodeCount);
+	for (int i = 0; i < observerCount; i++)
+	{
+		size_t offset = ((size_t) observerY[i] * rasterWidth + observerX[i]) * sizeof(float);
+		int n = placement == NUMA_REPLICATE ? i % nodeCount : (int) (offset / NUMA_INTERLEAVE_BYTES % nodeCount);
+		queues[n].push_back(i);
+	}
+	std::vector<LONG> queueNext(nodeCount, 0);
+
+	ULONGLONG startTicks = GetTickCount64();
+	volatile LONG observersDone = 0;
+	volatile LONG status = VIEWSHED_OK;
+
+	std::vector<int> workerNode;
+	for (int n = 0; n < nodeCount; n++)
+	{
+		for (int p = 0; p < nodes[n].processors; p++)
+		{
+			workerNode.push_back(n);
+		}
+	}
+
+	std::vector<std::thread> workers;
+	for (int w = 0; w < (int) workerNode.size(); w++)
+	{
+		workers.push_back(std::thread([&, w]
+		{
+			int n = workerNode[w];
+			int processor = 0;
+			for (int i = 0; i < w; i++)
+			{
+				processor += workerNode[i] == n ? 1 : 0;
+			}
+			ULONGLONG mask = processorMask(nodes[n].mask, processor);
+			if (mask != 0)
+			{
+				SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) mask);
+			}
+
+			//first touched here, so on this worker's node
+			std::vector<unsigned int> seen((cells + 31) / 32);
+			volatile LONG* counts = nodeCounts[n];
+			const float* dem = placement == NUMA_REPLICATE ? dems[n] : dems[0];
+
+			for (int q = 0; q < nodeCount && status == VIEWSHED_OK; q++)
+			{
+				int queue = (n + q) % nodeCount;
+				while (status == VIEWSHED_OK)
+				{
+					LONG next = InterlockedIncrement(&queueNext[queue]) - 1;
+					if (next >= (LONG) queues[queue].size())
+					{
+						break;
+					}
+
+					int i = queues[queue][next];
+					TraceScope trace("numa observer", i);
+					int currX = observerX[i];
+					int currY = observerY[i];
+					int cell = currY * rasterWidth + currX;
+					memset(&seen[0], 0, seen.size() * sizeof(unsigned int));
+					seen[cell >> 5] |= 1u << (cell & 31);
+					InterlockedIncrement(&counts[cell]);
+					for (int y = 0; y < rasterHeight; y++)
+					{
+						traceRayCpu(dem, rasterWidth, &seen[0], counts, currX, currY, observerZ[i], 0, y);
+						traceRayCpu(dem, rasterWidth, &seen[0], counts, currX, currY, observerZ[i], rasterWidth - 1, y);
+					}
+					for (int x = 0; x < rasterWidth; x++)
+					{
+						traceRayCpu(dem, rasterWidth, &seen[0], counts, currX, currY, observerZ[i], x, 0);
+						traceRayCpu(dem, rasterWidth, &seen[0], counts, currX, currY, observerZ[i], x, rasterHeight - 1);
+					}
+
+					jobProgress(job, InterlockedIncrement(&observersDone), observerCount);
+					int jobState = jobStatus(job, startTicks);
+					if (jobState != VIEWSHED_OK)
+					{
+						InterlockedCompareExchange(&status, jobState, VIEWSHED_OK);
+					}
+				}
+			}
+		}));
+	}
+	for (int w = 0; w < (int) workers.size(); w++)
+	{
+		workers[w].join();
+	}
+
+	parallel_for(0, rasterHeight, [&](int y)
+	{
+		for (int x = 0; x < rasterWidth; x++)
+		{
+			int total = 0;
+			for (int n = 0; n < nodeCount; n++)
+			{
+				total += nodeCounts[n][y * rasterWidth + x];
+			}
+			cumulativeArray[y * rasterWidth + x] = total;
+		}
+	});
+
+	for (int n = 0; n < nodeCount; n++)
+	{
+		if (dems[n] != NULL)
+		{
+			VirtualFree(dems[n], 0, MEM_RELEASE);
+		}
+		VirtualFree((void*) nodeCounts[n], 0, MEM_RELEASE);
+	}
+	return status;
+}
+
+
+//Node count, and up to maxNodes entries of processors per node
+int calcNumaTopology(int* nodeCount, int* nodeProcessors, int maxNodes)
+{
+	if (nodeCount == NULL || (nodeProcessors == NULL && maxNodes > 0))
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	std::vector<NumaNode> nodes = numaNodes();
+	*nodeCount = (int) nodes.size();
+	for (int n = 0; n < (int) nodes.size() && n < maxNodes; n++)
+	{
+		nodeProcessors[n] = nodes[n].processors;
+	}
+	return VIEWSHED_OK;
+}
+
+
+//Local read bandwidth of each node in GB/s, up to maxNodes entries: every processor of the node,
+//pinned, streams its share of a buffer committed on that node, best of NUMA_BANDWIDTH_PASSES
+int calcNumaBandwidth(double* nodeGigabytesPerSecond, int maxNodes)
+{
+	std::vector<NumaNode> nodes = numaNodes();
+
+	for (int n = 0; n < (int) nodes.size() && n < maxNodes; n++)
+	{
+		unsigned long long* buffer = (unsigned long long*) allocateOnNode(NUMA_BANDWIDTH_BYTES, nodes[n].node);
+		if (buffer == NULL)
+		{
+			return VIEWSHED_OUT_OF_MEMORY;
+		}
+		size_t words = NUMA_BANDWIDTH_BYTES / sizeof(unsigned long long);
+		int threads = nodes[n].processors;
+		double best = 0.0;
+
+		for (int pass = 0; pass <= NUMA_BANDWIDTH_PASSES; pass++)
+		{
+			LARGE_INTEGER start;
+			LARGE_INTEGER end;
+			LARGE_INTEGER frequency;
+			std::vector<unsigned long long> sums(threads);
+			std::vector<std::thread> readers;
+
+			QueryPerformanceCounter(&start);
+			for (int t = 0; t < threads; t++)
+			{
+				readers.push_back(std::thread([&, t]
+				{
+					ULONGLONG mask = processorMask(nodes[n].mask, t);
+					if (mask != 0)
+					{
+						SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) mask);
+					}
+					unsigned long long sum = 0;
+					for (size_t i = words * t / threads; i < words * (t + 1) / threads; i++)
+					{
+						sum += buffer[i];
+					}
+					sums[t] = sum;
+				}));
+			}
+			for (int t = 0; t < threads; t++)
+			{
+				readers[t].join();
+			}
+			QueryPerformanceCounter(&end);
+			QueryPerformanceFrequency(&frequency);
+
+			//pass 0 faults the pages in
+			double seconds = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+			if (pass > 0 && seconds > 0.0)
+			{
+				best = max(best, NUMA_BANDWIDTH_BYTES / seconds / 1e9);
+			}
+		}
+
+		VirtualFree(buffer, 0, MEM_RELEASE);
+		nodeGigabytesPerSecond[n] = best;
+	}
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingNumaViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int placement, int* cumulativeArray, ViewshedJob* job)
+{
+	return calcNumaViewshed(zArray, rasterWidth, rasterHeight, observerX, observerY, observerZ, observerCount, placement,
+		cumulativeArray, job);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingNumaTopology(int* nodeCount, int* nodeProcessors, int maxNodes)
+{
+	return calcNumaTopology(nodeCount, nodeProcessors, maxNodes);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingNumaBandwidth(double* nodeGigabytesPerSecond, int maxNodes)
+{
+	return calcNumaBandwidth(nodeGigabytesPerSecond, maxNodes);
+}
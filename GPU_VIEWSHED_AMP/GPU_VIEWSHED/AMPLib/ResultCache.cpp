@@ -0,0 +1,388 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+
+#define CACHE_MAGIC "VSRC"
+#define CACHE_VERSION 2
+
+//DEM hashing is split into this many blocks hashed in parallel
+#define CACHE_HASH_BLOCKS 64
+
+
+
+using namespace concurrency;
+
+
+//On-disk viewshed cache
+//
+//Each entry is keyed by a hash of the DEM contents, the raster size, the observer and the
+//algorithm, and holds the visibility raster run length coded: alternating runs of hidden and
+//visible cells as variable length integers. Entries are separate files in the cache
+//directory named after the key. A hit touches its file's write time, and after every insert
+//the oldest entries are deleted until the directory fits in maxCacheBytes, so the cache is an
+//LRU bounded by size. The full key is stored in the entry and checked, so two keys sharing a
+//file name are a miss rather than a wrong answer. The DEM itself is only in the key as hashes,
+//demHash and a second, independently mixed demCheck, so a different DEM is only mistaken for
+//the cached one if both of its 64 bit hashes collide.
+//Only visibility is cached: on a hit losArray is left as it was.
+
+
+struct CacheKey
+{
+	char magic[4];
+	int version;
+	unsigned long long demHash;
+	unsigned long long demCheck;
+	int rasterWidth;
+	int rasterHeight;
+	int currX;
+	int currY;
+	int currZ;
+	int gpuType;
+};
+
+
+inline unsigned long long mixHash(unsigned long long h, unsigned long long v)
+{
+	h ^= v;
+	h *= 1099511628211ULL;
+	return h ^ (h >> 29);
+}
+
+
+//Multiply, rotate, multiply, unrelated to mixHash so the two hashes collide independently
+inline unsigned long long mixCheck(unsigned long long h, unsigned long long v)
+{
+	h += v * 0x9E3779B97F4A7C15ULL;
+	h = h << 31 | h >> 33;
+	return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+
+//Both hashes of the DEM contents in one pass, the blocks are hashed in parallel then combined
+//in order. checkHash may be null.
+void demHashes(const float* zArray, int cellCount, unsigned long long* contentHash, unsigned long long* checkHash)
+{
+	std::vector<unsigned long long> blockHash(CACHE_HASH_BLOCKS);
+	std::vector<unsigned long long> blockCheck(CACHE_HASH_BLOCKS);
+	int blockSize = (cellCount + CACHE_HASH_BLOCKS - 1) / CACHE_HASH_BLOCKS;
+	bool check = checkHash != NULL;
+
+	parallel_for(0, CACHE_HASH_BLOCKS, [&](int b)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+		unsigned long long c = 0x27D4EB2F165667C5ULL;
+		const unsigned int* words = (const unsigned int*) zArray;
+		int end = min(cellCount, (b + 1) * blockSize);
+		for (int i = b * blockSize; i < end; i++)
+		{
+			h = mixHash(h, words[i]);
+			if (check)
+			{
+				c = mixCheck(c, words[i]);
+			}
+		}
+		blockHash[b] = h;
+		blockCheck[b] = c;
+	});
+
+	unsigned long long h = mixHash(14695981039346656037ULL, (unsigned long long) cellCount);
+	unsigned long long c = mixCheck(0x27D4EB2F165667C5ULL, (unsigned long long) cellCount);
+	for (int b = 0; b < CACHE_HASH_BLOCKS; b++)
+	{
+		h = mixHash(h, blockHash[b]);
+		c = mixCheck(c, blockCheck[b]);
+	}
+	*contentHash = h;
+	if (check)
+	{
+		*checkHash = c;
+	}
+}
+
+
+//Hash of the DEM contents
+unsigned long long demContentHash(const float* zArray, int cellCount)
+{
+	unsigned long long h;
+	demHashes(zArray, cellCount, &h, NULL);
+	return h;
+}
+
+
+std::string cacheEntryPath(const std::string &cacheDir, const CacheKey &key)
+{
+	unsigned long long h = key.demHash;
+	h = mixHash(h, (unsigned long long) key.rasterWidth << 32 | (unsigned int) key.rasterHeight);
+	h = mixHash(h, (unsigned long long) key.currX << 32 | (unsigned int) key.currY);
+	h = mixHash(h, (unsigned long long) key.currZ << 32 | (unsigned int) key.gpuType);
+
+	std::string name(16, '0');
+	for (int i = 15; i >= 0; i--, h >>= 4)
+	{
+		name[i] = "0123456789abcdef"[h & 15];
+	}
+	return cacheDir + "\\" + name + ".vsc";
+}
+
+
+//Seven bits a byte, low bits first, the top bit set on all but the last byte
+void writeVarint(std::vector<unsigned char> &out, unsigned int v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((unsigned char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char) v);
+}
+
+
+//The varint at in[pos], moving pos past it. False if it runs past size or overflows.
+bool readVarint(const unsigned char* in, size_t size, size_t &pos, unsigned int &v)
+{
+	v = 0;
+	int shift = 0;
+	do
+	{
+		if (pos >= size || shift > 28)
+		{
+			return false;
+		}
+		v |= (unsigned int) (in[pos] & 0x7F) << shift;
+		shift += 7;
+	} while (in[pos++] & 0x80);
+	return true;
+}
+
+
+//Runs of hidden then visible cells, starting with a possibly empty hidden run
+void encodeRuns(const int* visibleArray, int cellCount, std::vector<unsigned char> &out)
+{
+	int i = 0;
+	bool visible = false;
+	while (i < cellCount)
+	{
+		int run = 0;
+		while (i < cellCount && (visibleArray[i] != 0) == visible)
+		{
+			run++;
+			i++;
+		}
+		writeVarint(out, run);
+		visible = !visible;
+	}
+}
+
+
+bool decodeRuns(const std::vector<unsigned char> &in, int* visibleArray, int cellCount)
+{
+	size_t pos = 0;
+	int i = 0;
+	bool visible = false;
+	while (i < cellCount)
+	{
+		unsigned int run = 0;
+		if (!readVarint(in.data(), in.size(), pos, run) || run > (unsigned int) (cellCount - i))
+		{
+			return false;
+		}
+		for (unsigned int k = 0; k < run; k++)
+		{
+			visibleArray[i++] = visible ? 1 : 0;
+		}
+		visible = !visible;
+	}
+	return true;
+}
+
+
+bool readCacheEntry(const std::string &path, const CacheKey &key, int* visibleArray, int cellCount)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	CacheKey stored;
+	if (!file.read((char*) &stored, sizeof(stored)) || memcmp(&stored, &key, sizeof(key)) != 0)
+	{
+		return false;
+	}
+
+	std::vector<unsigned char> runs((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (!decodeRuns(runs, visibleArray, cellCount))
+	{
+		return false;
+	}
+
+	//most recently used
+	HANDLE handle = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle != INVALID_HANDLE_VALUE)
+	{
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		SetFileTime(handle, NULL, NULL, &now);
+		CloseHandle(handle);
+	}
+	return true;
+}
+
+
+//Written to a temporary file first so readers never see half an entry
+bool writeCacheEntry(const std::string &path, const CacheKey &key, const int* visibleArray, int cellCount)
+{
+	std::vector<unsigned char> runs;
+	encodeRuns(visibleArray, cellCount, runs);
+
+	std::ostringstream tempName;
+	tempName << path << "." << GetCurrentProcessId() << ".tmp";
+	std::string temp = tempName.str();
+	{
+		std::ofstream file(temp.c_str(), std::ios::binary | std::ios::trunc);
+		file.write((const char*) &key, sizeof(key));
+		file.write((const char*) runs.data(), runs.size());
+		if (!file)
+		{
+			return false;
+		}
+	}
+	return MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+
+struct CacheFile
+{
+	unsigned long long lastWrite;
+	unsigned long long size;
+	std::string name;
+
+	bool operator<(const CacheFile &other) const
+	{
+		return lastWrite < other.lastWrite;
+	}
+};
+
+
+//Delete least recently used entries until the directory holds at most maxCacheBytes
+void evictCache(const std::string &cacheDir, long long maxCacheBytes)
+{
+	std::vector<CacheFile> files;
+	unsigned long long total = 0;
+
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA((cacheDir + "\\*.vsc").c_str(), &found);
+	if (search == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+	do
+	{
+		CacheFile f;
+		f.lastWrite = (unsigned long long) found.ftLastWriteTime.dwHighDateTime << 32 | found.ftLastWriteTime.dwLowDateTime;
+		f.size = (unsigned long long) found.nFileSizeHigh << 32 | found.nFileSizeLow;
+		f.name = found.cFileName;
+		files.push_back(f);
+		total += f.size;
+	} while (FindNextFileA(search, &found));
+	FindClose(search);
+
+	std::sort(files.begin(), files.end());
+	for (int i = 0; i < (int) files.size() && total > (unsigned long long) maxCacheBytes; i++)
+	{
+		if (DeleteFileA((cacheDir + "\\" + files[i].name).c_str()))
+		{
+			total -= files[i].size;
+		}
+	}
+}
+
+
+//stagingJob through the cache in cacheDir, created if missing. visibleArray is overwritten
+//with the 0/1 result, and XDRAW is seeded here rather than by the host, so a run depends only
+//on the key. cacheHit is set to 1 when the result came from the cache and staging was skipped;
+//losArray is then untouched, so callers wanting XDRAW's line of sight should use stagingJob.
+//Cancelled or timed out runs are not stored.
+int calcCached(float* zArray, int rasterWidth, int rasterHeight, int* visibleArray, float* losArray,
+	int currX, int currY, int currZ, int gpuType, const char* cacheDir, long long maxCacheBytes, ViewshedJob* job, int* cacheHit)
+{
+	if (currX < 0 || currX >= rasterWidth || currY < 0 || currY >= rasterHeight || cacheDir == NULL || maxCacheBytes < 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	int cellCount = rasterWidth * rasterHeight;
+	if (gpuType == AUTO)
+	{
+		gpuType = tunedAlgorithm(rasterWidth, rasterHeight);
+	}
+
+	CacheKey key;
+	memset(&key, 0, sizeof(key));
+	memcpy(key.magic, CACHE_MAGIC, 4);
+	key.version = CACHE_VERSION;
+	demHashes(zArray, cellCount, &key.demHash, &key.demCheck);
+	key.rasterWidth = rasterWidth;
+	key.rasterHeight = rasterHeight;
+	key.currX = currX;
+	key.currY = currY;
+	key.currZ = currZ;
+	key.gpuType = gpuType;
+
+	std::string dir(cacheDir);
+	std::string path = cacheEntryPath(dir, key);
+
+	if (cacheHit != NULL)
+	{
+		*cacheHit = 0;
+	}
+	if (readCacheEntry(path, key, visibleArray, cellCount))
+	{
+		if (cacheHit != NULL)
+		{
+			*cacheHit = 1;
+		}
+		return VIEWSHED_OK;
+	}
+
+	memset(visibleArray, 0, cellCount * sizeof(int));
+	visibleArray[currY * rasterWidth + currX] = 1;
+	if (gpuType == XDRAW)
+	{
+		seedXdraw(zArray, visibleArray, losArray, rasterWidth, rasterHeight, currX, currY, currZ);
+	}
+
+	int status = stagingJob(zArray, rasterWidth, rasterHeight, visibleArray, rasterWidth, rasterHeight, currX, currY, currZ,
+		rasterWidth, rasterHeight, losArray, gpuType, job);
+	if (status != VIEWSHED_OK)
+	{
+		return status;
+	}
+
+	for (int i = 0; i < cellCount; i++)
+	{
+		visibleArray[i] = visibleArray[i] != 0 ? 1 : 0;
+	}
+
+	CreateDirectoryA(cacheDir, NULL);
+	if (writeCacheEntry(path, key, visibleArray, cellCount))
+	{
+		evictCache(dir, maxCacheBytes);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingCached(float* zArray, int rasterWidth, int rasterHeight, int* visibleArray, float* losArray,
+	int currX, int currY, int currZ, int gpuType, const char* cacheDir, long long maxCacheBytes, ViewshedJob* job, int* cacheHit)
+{
+	return calcCached(zArray, rasterWidth, rasterHeight, visibleArray, losArray, currX, currY, currZ, gpuType,
+		cacheDir, maxCacheBytes, job, cacheHit);
+}
@@ -0,0 +1,334 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <concrt.h>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstring>
+
+
+
+using namespace concurrency;
+
+
+//Raster buffers owned by the library and written by the host in place
+//
+//The host gets pointers to the DEM and visibility rasters and fills or reads them directly,
+//so it needs no managed copies and nothing is pinned per call. The XDRAW line of sight raster
+//is scratch and stays private; the compass lines the host used to seed into it are traced
+//here instead. Buffers come from VirtualAlloc, so they are page aligned and zeroed, and can be
+//backed by large pages when the process holds SeLockMemoryPrivilege.
+
+
+struct SharedBuffers
+{
+	int width;
+	int height;
+	float* zArray;
+	int* visibleArray;
+	float* losArray;
+	bool largePages;
+};
+
+
+//Allocated buffer sets, the handle is the slot number
+static std::vector<std::shared_ptr<SharedBuffers> > sharedBuffers;
+static critical_section sharedBuffersLock;
+
+
+//Page aligned zeroed memory, on large pages if asked and allowed
+void* allocateRaster(size_t bytes, bool wantLargePages, bool &gotLargePages)
+{
+	gotLargePages = false;
+
+	if (wantLargePages)
+	{
+		size_t largePage = GetLargePageMinimum();
+		if (largePage > 0)
+		{
+			size_t rounded = (bytes + largePage - 1) / largePage * largePage;
+			void* p = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p != NULL)
+			{
+				gotLargePages = true;
+				return p;
+			}
+		}
+	}
+
+	return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+
+//Deleter of a registered buffer set, run once nothing holds it
+void freeSharedBuffers(SharedBuffers* buffers)
+{
+	if (buffers->zArray != NULL)
+	{
+		VirtualFree(buffers->zArray, 0, MEM_RELEASE);
+	}
+	if (buffers->visibleArray != NULL)
+	{
+		VirtualFree(buffers->visibleArray, 0, MEM_RELEASE);
+	}
+	if (buffers->losArray != NULL)
+	{
+		VirtualFree(buffers->losArray, 0, MEM_RELEASE);
+	}
+	delete buffers;
+}
+
+
+//Returns a handle, or a negative status. zArray and visibleArray receive the host's views of
+//the rasterWidth x rasterHeight DEM and visibility rasters, row major.
+//usedLargePages is set to 1 if every buffer landed on large pages.
+int calcCreateBuffers(int rasterWidth, int rasterHeight, int useLargePages, float** zArray, int** visibleArray, int* usedLargePages)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	size_t cells = (size_t) rasterWidth * rasterHeight;
+	bool large[3];
+
+	std::shared_ptr<SharedBuffers> buffers(new SharedBuffers(), freeSharedBuffers);
+	buffers->width = rasterWidth;
+	buffers->height = rasterHeight;
+	buffers->zArray = (float*) allocateRaster(cells * sizeof(float), useLargePages != 0, large[0]);
+	buffers->visibleArray = (int*) allocateRaster(cells * sizeof(int), useLargePages != 0, large[1]);
+	buffers->losArray = (float*) allocateRaster(cells * sizeof(float), useLargePages != 0, large[2]);
+	buffers->largePages = large[0] && large[1] && large[2];
+
+	if (buffers->zArray == NULL || buffers->visibleArray == NULL || buffers->losArray == NULL)
+	{
+		return VIEWSHED_OUT_OF_MEMORY;
+	}
+
+	*zArray = buffers->zArray;
+	*visibleArray = buffers->visibleArray;
+	if (usedLargePages != NULL)
+	{
+		*usedLargePages = buffers->largePages ? 1 : 0;
+	}
+
+	critical_section::scoped_lock lock(sharedBuffersLock);
+	for (int i = 0; i < (int) sharedBuffers.size(); i++)
+	{
+		if (!sharedBuffers[i])
+		{
+			sharedBuffers[i] = buffers;
+			return i;
+		}
+	}
+	sharedBuffers.push_back(buffers);
+	return (int) sharedBuffers.size() - 1;
+}
+
+
+//A reference to a buffer set, empty for a bad handle. Held for as long as the buffers are used.
+std::shared_ptr<SharedBuffers> findSharedBuffers(int handle)
+{
+	critical_section::scoped_lock lock(sharedBuffersLock);
+	if (handle < 0 || handle >= (int) sharedBuffers.size())
+	{
+		return std::shared_ptr<SharedBuffers>();
+	}
+	return sharedBuffers[handle];
+}
+
+
+//One compass line for XDRAW, traced on the CPU as the add-in's preCalculateDDA did: the running
+//line of sight into losArray, and the cells seen from the observer appended to seenCells. The
+//add-in counted those in visibleArrayCPU rather than the raster the kernels write, so they are
+//added to visibleArray by the caller, see seedXdraw and calcBuffered.
+void seedCompassLine(const SharedBuffers &b, int currX, int currY, int currZ, int destX, int destY, std::vector<int> &seenCells)
+{
+	int dx = destX - currX;
+	int dy = destY - currY;
+	int steps = max(abs(dx), abs(dy));
+	if (steps == 0)
+	{
+		return;
+	}
+
+	float xIncrement = dx / (float) steps;
+	float yIncrement = dy / (float) steps;
+	float x = (float) currX;
+	float y = (float) currY;
+
+	//previously highest LOS
+	float highest = -999.0f;
+
+	for (int k = 0; k < steps; k++)
+	{
+		x += xIncrement;
+		y += yIncrement;
+
+		int cellX = (int) x;
+		int cellY = (int) y;
+		int roundX = (int) floor(x + 0.5f);
+		int roundY = (int) floor(y + 0.5f);
+		if (cellX < 0 || cellX >= b.width || cellY < 0 || cellY >= b.height
+			|| roundX < 0 || roundX >= b.width || roundY < 0 || roundY >= b.height)
+		{
+			break;
+		}
+
+		float dist = sqrt((x - currX) * (x - currX) + (y - currY) * (y - currY));
+		float elev = (b.zArray[cellY * b.width + cellX] - currZ) / dist;
+
+		if (elev > highest)
+		{
+			seenCells.push_back(cellY * b.width + cellX);
+			highest = elev;
+		}
+		b.losArray[roundY * b.width + roundX] = highest;
+	}
+}
+
+
+//The compass lines and the ring of neighbours XDRAW starts from, as set up by the add-in.
+//The diagonals stop where they leave the raster, exactly on the 45 degree line.
+void seedCompass(const SharedBuffers &b, int currX, int currY, int currZ, std::vector<int> &seenCells)
+{
+	int width = b.width;
+	int height = b.height;
+
+	seedCompassLine(b, currX, currY, currZ, currX, height - 1, seenCells);
+	seedCompassLine(b, currX, currY, currZ, currX, 0, seenCells);
+	seedCompassLine(b, currX, currY, currZ, 0, currY, seenCells);
+	seedCompassLine(b, currX, currY, currZ, width - 1, currY, seenCells);
+
+	//NW, x falling as y rises to the top row
+	int destX = currX - (height - 1 - currY);
+	int destY = height - 1;
+	if (destX <= 0)
+	{
+		destY = height - 1 + destX;
+		destX = 0;
+	}
+	seedCompassLine(b, currX, currY, currZ, destX, destY, seenCells);
+
+	//SE, x rising as y falls to the bottom row
+	destX = currX + currY;
+	destY = 0;
+	if (destX >= width - 1)
+	{
+		destY = destX - (width - 1);
+		destX = width - 1;
+	}
+	seedCompassLine(b, currX, currY, currZ, destX, destY, seenCells);
+
+	//SW
+	destX = currX - currY;
+	destY = 0;
+	if (destX <= 0)
+	{
+		destY = -destX;
+		destX = 0;
+	}
+	seedCompassLine(b, currX, currY, currZ, destX, destY, seenCells);
+
+	for (int ny = currY - 1; ny <= currY + 1; ny++)
+	{
+		for (int nx = currX - 1; nx <= currX + 1; nx++)
+		{
+			if (nx >= 0 && nx < width && ny >= 0 && ny < height)
+			{
+				b.visibleArray[ny * width + nx] = 1;
+			}
+		}
+	}
+}
+
+
+//Add one to each cell the compass lines saw, as the add-in's visibleArrayCPU did
+void addSeenCells(int* visibleArray, const std::vector<int> &seenCells)
+{
+	for (int i = 0; i < (int) seenCells.size(); i++)
+	{
+		visibleArray[seenCells[i]]++;
+	}
+}
+
+
+//seedCompass on caller owned rasters, for staging's AUTO mode
+void seedXdraw(float* zArray, int* visibleArray, float* losArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ)
+{
+	SharedBuffers b = { rasterWidth, rasterHeight, zArray, visibleArray, losArray, false };
+	std::vector<int> seenCells;
+	seedCompass(b, currX, currY, currZ, seenCells);
+	addSeenCells(visibleArray, seenCells);
+}
+
+
+//stagingJob on a shared buffer set, job may be null. Both rasters are cleared first, so the
+//visibility is this observer's alone. The compass line cells are added after the kernel has run,
+//so visibleArray holds what the add-in summed from visibleArrayInt and visibleArrayCPU.
+int calcBuffered(int handle, int currX, int currY, int currZ, int gpuType, ViewshedJob* job)
+{
+	std::shared_ptr<SharedBuffers> b = findSharedBuffers(handle);
+	if (!b || currX < 0 || currX >= b->width || currY < 0 || currY >= b->height)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	size_t cells = (size_t) b->width * b->height;
+	memset(b->visibleArray, 0, cells * sizeof(int));
+	memset(b->losArray, 0, cells * sizeof(float));
+
+	b->visibleArray[currY * b->width + currX] = 1;
+
+	if (gpuType == AUTO)
+	{
+		gpuType = tunedAlgorithm(b->width, b->height);
+	}
+	std::vector<int> seenCells;
+	if (gpuType == XDRAW)
+	{
+		seedCompass(*b, currX, currY, currZ, seenCells);
+	}
+
+	int status = stagingJob(b->zArray, b->width, b->height, b->visibleArray, b->width, b->height, currX, currY, currZ,
+		b->width, b->height, b->losArray, gpuType, job);
+
+	addSeenCells(b->visibleArray, seenCells);
+	return status;
+}
+
+
+int calcFreeBuffers(int handle)
+{
+	critical_section::scoped_lock lock(sharedBuffersLock);
+	if (handle < 0 || handle >= (int) sharedBuffers.size() || !sharedBuffers[handle])
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	//a job still running on the buffers keeps them until it finishes
+	sharedBuffers[handle].reset();
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingCreateBuffers(int rasterWidth, int rasterHeight, int useLargePages, float** zArray, int** visibleArray,
+	int* usedLargePages)
+{
+	return calcCreateBuffers(rasterWidth, rasterHeight, useLargePages, zArray, visibleArray, usedLargePages);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingBuffered(int handle, int currX, int currY, int currZ, int gpuType, ViewshedJob* job)
+{
+	return calcBuffered(handle, currX, currY, currZ, gpuType, job);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingFreeBuffers(int handle)
+{
+	return calcFreeBuffers(handle);
+}
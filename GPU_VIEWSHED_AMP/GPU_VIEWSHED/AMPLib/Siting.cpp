@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <vector>
+#include <queue>
+#include <utility>
+#include <new>
+
+
+
+//Greedy observer siting: choose siteCount candidates that together see the most cells
+//
+//Every candidate's viewshed is computed once on the accelerator and kept as run lengths of
+//hidden and visible cells, varints as in the result cache, so a candidate costs a few bytes per
+//run rather than a bit per raster cell and thousands of them fit in a 32 bit process. Gains are
+//counted run by run against the one coverage bitmap. Selection is lazy greedy maximum
+//coverage: candidates sit in a max heap keyed by their last known gain, and since gains can
+//only shrink as coverage grows, a popped candidate whose recomputed gain still beats the next
+//heap entry is the true best and is taken without re-scoring the rest.
+
+
+//A candidate viewshed, alternating runs of hidden then visible cells in raster order starting
+//with a possibly empty hidden run, each written with writeVarint
+struct SiteRuns
+{
+	std::vector<unsigned char> runs;
+};
+
+
+//Number of set bits in a word
+inline int countBits(unsigned int v)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+
+//Bits [first, first + count) of a word, count 1 to 32
+inline unsigned int bitRange(int first, int count)
+{
+	return (count == 32 ? 0xFFFFFFFFu : (1u << count) - 1) << first;
+}
+
+
+//Runs of a packed viewshed of cellCount cells, words all one way are taken whole
+void encodeSiteRuns(const unsigned int* bits, int cellCount, std::vector<unsigned char> &out)
+{
+	int runStart = 0;
+	bool visible = false;
+	int cell = 0;
+	while (cell < cellCount)
+	{
+		unsigned int word = bits[cell >> 5];
+		if ((cell & 31) == 0 && word == (visible ? 0xFFFFFFFFu : 0u))
+		{
+			cell += 32;
+			continue;
+		}
+		if (((word >> (cell & 31)) & 1) != (visible ? 1u : 0u))
+		{
+			writeVarint(out, cell - runStart);
+			runStart = cell;
+			visible = !visible;
+			continue;
+		}
+		cell++;
+	}
+	writeVarint(out, cellCount - runStart);
+}
+
+
+//Covered cells in [first, first + count)
+int coveredInRange(const std::vector<unsigned int> &covered, int first, int count)
+{
+	int total = 0;
+	while (count > 0)
+	{
+		int bit = first & 31;
+		int take = min(32 - bit, count);
+		total += countBits(covered[first >> 5] & bitRange(bit, take));
+		first += take;
+		count -= take;
+	}
+	return total;
+}
+
+
+//Mark [first, first + count) covered
+void coverRange(std::vector<unsigned int> &covered, int first, int count)
+{
+	while (count > 0)
+	{
+		int bit = first & 31;
+		int take = min(32 - bit, count);
+		covered[first >> 5] |= bitRange(bit, take);
+		first += take;
+		count -= take;
+	}
+}
+
+
+//Calls onVisible(first, count) for each visible run of a candidate
+template <typename F>
+void forEachVisibleRun(const SiteRuns &site, F onVisible)
+{
+	size_t pos = 0;
+	int cell = 0;
+	bool visible = false;
+	unsigned int run;
+	while (readVarint(site.runs.data(), site.runs.size(), pos, run))
+	{
+		if (visible && run > 0)
+		{
+			onVisible(cell, (int) run);
+		}
+		cell += (int) run;
+		visible = !visible;
+	}
+}
+
+
+//Cells a candidate would add to the current coverage
+int marginalGain(const SiteRuns &site, const std::vector<unsigned int> &covered)
+{
+	int gain = 0;
+	forEachVisibleRun(site, [&](int first, int count)
+	{
+		gain += count - coveredInRange(covered, first, count);
+	});
+	return gain;
+}
+
+
+//calcSiting once the arguments are checked, throws std::bad_alloc if the runs don't fit
+int chooseSites(float* zArray, int rasterWidth, int rasterHeight, int* candidateX, int* candidateY, int* candidateZ,
+	int candidateCount, int siteCount, int* chosenSites, int* coverageCurve, int* chosenCount)
+{
+	std::vector<SiteRuns> sites(candidateCount);
+
+	int status = calcEachViewshed(zArray, rasterWidth, rasterHeight, candidateX, candidateY, candidateZ, candidateCount,
+		[&](int candidate, const unsigned int* bits)
+	{
+		encodeSiteRuns(bits, rasterWidth * rasterHeight, sites[candidate].runs);
+		sites[candidate].runs.shrink_to_fit();
+	});
+
+	if (status != VIEWSHED_OK)
+	{
+		return status;
+	}
+
+	std::vector<unsigned int> covered((rasterWidth * rasterHeight + 31) / 32, 0);
+
+	//(gain, candidate), gains start as each candidate's full viewshed
+	std::priority_queue<std::pair<int, int> > heap;
+	for (int i = 0; i < candidateCount; i++)
+	{
+		heap.push(std::make_pair(marginalGain(sites[i], covered), i));
+	}
+
+	int coverage = 0;
+
+	while (*chosenCount < siteCount && !heap.empty())
+	{
+		std::pair<int, int> top = heap.top();
+		heap.pop();
+
+		int gain = marginalGain(sites[top.second], covered);
+
+		//stale entry, put it back with its real gain
+		if (!heap.empty() && gain < heap.top().first)
+		{
+			heap.push(std::make_pair(gain, top.second));
+			continue;
+		}
+
+		if (gain == 0)
+		{
+			break;
+		}
+
+		forEachVisibleRun(sites[top.second], [&](int first, int count)
+		{
+			coverRange(covered, first, count);
+		});
+
+		coverage += gain;
+		chosenSites[*chosenCount] = top.second;
+		coverageCurve[*chosenCount] = coverage;
+		(*chosenCount)++;
+
+		//its runs aren't needed again
+		std::vector<unsigned char>().swap(sites[top.second].runs);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+//chosenSites receives up to siteCount candidate indices in pick order and coverageCurve the
+//total covered cells after each pick. chosenCount is set to the number picked, which is smaller
+//than siteCount if the remaining candidates add nothing. Returns VIEWSHED_OUT_OF_MEMORY if the
+//candidates' runs don't fit.
+int calcSiting(float* zArray, int rasterWidth, int rasterHeight, int* candidateX, int* candidateY, int* candidateZ,
+	int candidateCount, int siteCount, int* chosenSites, int* coverageCurve, int* chosenCount)
+{
+	*chosenCount = 0;
+	if (siteCount <= 0 || candidateCount <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	try
+	{
+		return chooseSites(zArray, rasterWidth, rasterHeight, candidateX, candidateY, candidateZ,
+			candidateCount, siteCount, chosenSites, coverageCurve, chosenCount);
+	}
+	catch (const std::bad_alloc &)
+	{
+		return VIEWSHED_OUT_OF_MEMORY;
+	}
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingSiting(float* zArray, int rasterWidth, int rasterHeight, int* candidateX, int* candidateY, int* candidateZ,
+	int candidateCount, int siteCount, int* chosenSites, int* coverageCurve, int* chosenCount)
+{
+	return calcSiting(zArray, rasterWidth, rasterHeight, candidateX, candidateY, candidateZ,
+		candidateCount, siteCount, chosenSites, coverageCurve, chosenCount);
+}
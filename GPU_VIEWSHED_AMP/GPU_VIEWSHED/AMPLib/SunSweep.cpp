@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+
+
+//Directional sweep: visibility from an observer at infinity, e.g. the sun
+//
+//For a source along compass azimuth A at elevation E, a cell is lit unless some cell further
+//towards the source rises above the ray leaving it at angle E. Row 0 is the north edge, as the
+//add-in fills rasters, so north is -y and east +x.
+//Measuring s along the direction to the source, the cell at s is shadowed exactly when
+//z(s') - s' * tan(E) > z(s) - s * tan(E) for some s' > s, so each line of cells parallel to the
+//source is one independent scan from the source side carrying the running maximum of
+//z - s * tan(E). Lines come from the same decomposition as the total viewshed.
+
+
+//Add hours to every lit cell for one source position
+void sweepSunPosition(float* zArray, int rasterWidth, int rasterHeight, float azimuth, float elevation,
+	float cellSize, float hours, float* sunHoursArray)
+{
+	//rows run north to south, so north is -y
+	float dirX = sin(azimuth);
+	float dirY = -cos(azimuth);
+	float rise = tan(elevation);
+
+	parallelLines(rasterWidth, rasterHeight, atan2(dirY, dirX), [&](const std::vector<int> &cells, float stepLength)
+	{
+		int n = (int) cells.size();
+
+		//walk from whichever end of the line is nearest the source
+		int first = cells[0];
+		int last = cells[n - 1];
+		float sFirst = (first % rasterWidth) * dirX + (first / rasterWidth) * dirY;
+		float sLast = (last % rasterWidth) * dirX + (last / rasterWidth) * dirY;
+		int begin = sFirst > sLast ? 0 : n - 1;
+		int step = sFirst > sLast ? 1 : -1;
+
+		//running horizon, highest z - s * tan(E) seen so far
+		float highest = -FLT_MAX;
+
+		for (int i = begin; i >= 0 && i < n; i += step)
+		{
+			int cell = cells[i];
+			float s = ((cell % rasterWidth) * dirX + (cell / rasterWidth) * dirY) * cellSize;
+			float h = zArray[cell] - s * rise;
+
+			if (h >= highest)
+			{
+				sunHoursArray[cell] += hours;
+				highest = h;
+			}
+		}
+	});
+}
+
+
+//sunAzimuth and sunElevation are in radians, azimuth clockwise from north (-y, towards row 0).
+//positionHours gives the time each position stands for, or null to count positions.
+//Positions at or below the horizon light nothing. cellSize converts cells to DEM height units.
+//sunHoursArray is rasterWidth x rasterHeight and is overwritten with the total.
+int calcSunHours(float* zArray, int rasterWidth, int rasterHeight, float cellSize,
+	float* sunAzimuth, float* sunElevation, float* positionHours, int positionCount, float* sunHoursArray)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0 || cellSize <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	for (int i = 0; i < rasterWidth * rasterHeight; i++)
+	{
+		sunHoursArray[i] = 0.0f;
+	}
+
+	for (int p = 0; p < positionCount; p++)
+	{
+		if (sunElevation[p] <= 0)
+		{
+			continue;
+		}
+
+		float hours = positionHours != NULL ? positionHours[p] : 1.0f;
+		sweepSunPosition(zArray, rasterWidth, rasterHeight, sunAzimuth[p], sunElevation[p], cellSize, hours, sunHoursArray);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingSunHours(float* zArray, int rasterWidth, int rasterHeight, float cellSize,
+	float* sunAzimuth, float* sunElevation, float* positionHours, int positionCount, float* sunHoursArray)
+{
+	return calcSunHours(zArray, rasterWidth, rasterHeight, cellSize, sunAzimuth, sunElevation, positionHours,
+		positionCount, sunHoursArray);
+}
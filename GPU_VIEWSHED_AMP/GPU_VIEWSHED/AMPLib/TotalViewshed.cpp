@@ -0,0 +1,204 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <ppl.h>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+
+#define TOTAL_PI 3.14159265358979f
+
+
+
+using namespace concurrency;
+
+
+//Total viewshed: for every cell, an estimate of how many cells it can see
+//
+//The raster is swept once per pair of opposite sector directions. For a direction the raster
+//is cut into parallel lines of cells, and each line's height profile is pulled out once and
+//shared by every observer on it, walking forwards and backwards along it. This is a profile
+//sweep, not a band of sight: each observer walks its own line, so the work is
+//O(cells * sectors * min(line length, maxRadius)) in the worst case.
+//What the observers on a line do share is the highest height from each sample onwards in
+//each direction. A walk stops once its horizon is above anything left on the line, so behind
+//a dominant ridge an observer costs far less than the line length.
+//An observer keeps a running horizon out to maxRadius, and every visible sample at distance r
+//stands for the slice of its sector at that distance, r * sectorAngle * stepLength cells. The
+//result is that area summed over the sectors, an estimate in cells rather than a count.
+
+
+//Visible area along one direction of a profile, from the observer at index i. reachMax[j] is
+//the highest profile height from j onwards in this direction.
+float sweepProfile(const std::vector<float> &profile, const std::vector<float> &reachMax, int i, int direction,
+	float stepLength, float observerHeight, float targetHeight, int maxSteps)
+{
+	int n = (int) profile.size();
+	float zObs = profile[i] + observerHeight;
+
+	//previously highest LOS
+	float highest = -FLT_MAX;
+	float visibleArea = 0.0f;
+
+	for (int k = 1; k <= maxSteps; k++)
+	{
+		int j = i + k * direction;
+		if (j < 0 || j >= n)
+		{
+			break;
+		}
+
+		float dist = k * stepLength;
+
+		//nothing from here on can reach the horizon, the highest target left gets no steeper
+		//with distance above the observer and can't climb past 0 below it
+		float top = reachMax[j] + targetHeight - zObs;
+		if (top >= 0 ? top / dist < highest : highest >= 0)
+		{
+			break;
+		}
+
+		float elev = (profile[j] - zObs) / dist;
+		float targetElev = (profile[j] + targetHeight - zObs) / dist;
+
+		if (targetElev >= highest)
+		{
+			visibleArea += dist;
+		}
+		if (elev > highest)
+		{
+			highest = elev;
+		}
+	}
+
+	return visibleArea;
+}
+
+
+//Cut the raster into parallel lines of cells running along (cos(theta), sin(theta)) and hand
+//each one to onLine, cells in order of increasing major axis, with the distance between them.
+//Every cell is on exactly one line, so lines are processed in parallel and may write to their
+//own cells without locking.
+void parallelLines(int rasterWidth, int rasterHeight, float theta,
+	const std::function<void(const std::vector<int>&, float)> &onLine)
+{
+	float dirX = cos(theta);
+	float dirY = sin(theta);
+
+	//Step along whichever axis the direction is closest to
+	bool xMajor = fabs(dirX) >= fabs(dirY);
+	int majorLength = xMajor ? rasterWidth : rasterHeight;
+	int minorLength = xMajor ? rasterHeight : rasterWidth;
+	float slope = xMajor ? dirY / dirX : dirX / dirY;
+	float stepLength = sqrt(1.0f + slope * slope);
+
+	//Minor axis offset of the line at the far end of the major axis
+	int endOffset = (int) floor((majorLength - 1) * slope + 0.5f);
+	int minOffset = min(0, endOffset);
+	int maxOffset = max(0, endOffset);
+	int lineCount = minorLength + maxOffset - minOffset;
+
+	parallel_for(0, lineCount, [&](int line)
+	{
+		int start = line - maxOffset;
+
+		std::vector<int> cells;
+		cells.reserve(majorLength);
+
+		for (int major = 0; major < majorLength; major++)
+		{
+			int minor = start + (int) floor(major * slope + 0.5f);
+			if (minor < 0 || minor >= minorLength)
+			{
+				continue;
+			}
+
+			cells.push_back(xMajor ? minor * rasterWidth + major : major * rasterWidth + minor);
+		}
+
+		if (!cells.empty())
+		{
+			onLine(cells, stepLength);
+		}
+	});
+}
+
+
+//Sweep every line of cells running along the direction theta and its opposite
+void sweepDirection(float* zArray, int rasterWidth, int rasterHeight, float theta, float sectorAngle,
+	float observerHeight, float targetHeight, float maxRadius, float* countArray)
+{
+	parallelLines(rasterWidth, rasterHeight, theta, [&](const std::vector<int> &cells, float stepLength)
+	{
+		int maxSteps = maxRadius > 0 ? (int) (maxRadius / stepLength) : (int) cells.size();
+
+		int n = (int) cells.size();
+		std::vector<float> profile(n);
+		for (int i = 0; i < n; i++)
+		{
+			profile[i] = zArray[cells[i]];
+		}
+
+		//Highest height ahead of each sample, walking forwards and backwards
+		std::vector<float> forwardMax(n);
+		std::vector<float> backwardMax(n);
+		forwardMax[n - 1] = profile[n - 1];
+		for (int i = n - 2; i >= 0; i--)
+		{
+			forwardMax[i] = max(profile[i], forwardMax[i + 1]);
+		}
+		backwardMax[0] = profile[0];
+		for (int i = 1; i < n; i++)
+		{
+			backwardMax[i] = max(profile[i], backwardMax[i - 1]);
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			float area = sweepProfile(profile, forwardMax, i, 1, stepLength, observerHeight, targetHeight, maxSteps)
+				+ sweepProfile(profile, backwardMax, i, -1, stepLength, observerHeight, targetHeight, maxSteps);
+
+			countArray[cells[i]] += area * stepLength * sectorAngle;
+		}
+	});
+}
+
+
+//countArray is rasterWidth x rasterHeight and receives the estimated visible cell count,
+//including the cell itself, as a float area in cells, not a whole number of cells seen.
+//maxRadius is in cells, 0 for no limit.
+//sectorCount is rounded up to an even number since opposite sectors share their lines.
+int calcTotalViewshed(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float targetHeight,
+	float maxRadius, int sectorCount, float* countArray)
+{
+	if (rasterWidth <= 0 || rasterHeight <= 0 || sectorCount <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	int halfSectors = (sectorCount + 1) / 2;
+	float sectorAngle = TOTAL_PI / halfSectors;
+
+	for (int i = 0; i < rasterWidth * rasterHeight; i++)
+	{
+		countArray[i] = 1.0f;
+	}
+
+	for (int s = 0; s < halfSectors; s++)
+	{
+		sweepDirection(zArray, rasterWidth, rasterHeight, s * sectorAngle, sectorAngle,
+			observerHeight, targetHeight, maxRadius, countArray);
+	}
+
+	return VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingTotal(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float targetHeight,
+	float maxRadius, int sectorCount, float* countArray)
+{
+	return calcTotalViewshed(zArray, rasterWidth, rasterHeight, observerHeight, targetHeight,
+		maxRadius, sectorCount, countArray);
+}
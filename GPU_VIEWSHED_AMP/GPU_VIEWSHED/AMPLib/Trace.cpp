@@ -0,0 +1,215 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include <concrt.h>
+#include <vector>
+#include <set>
+#include <string>
+#include <fstream>
+
+
+//Events kept per thread, older ones are overwritten
+#define TRACE_BUFFER_EVENTS 65536
+
+
+
+using namespace concurrency;
+
+
+//Timeline tracing
+//
+//Every thread that records an event gets its own ring buffer, registered once, and only that
+//thread writes to it, so recording takes no lock. stagingStartTrace clears the buffers and
+//turns tracing on, stagingStopTrace turns it off, and stagingWriteTrace dumps what the buffers
+//hold as Chrome trace event JSON (chrome://tracing, Perfetto). Start and write while tracing
+//is off; a thread still finishing an event may otherwise race the reset or the dump.
+//
+//Kernels run asynchronously, so an event round a dispatch measures its submission unless the
+//code waits on the accelerator inside it. The DDA and R3 kernels are waited on while tracing
+//so their events cover the rays; XDRAW rings are left asynchronous and show dispatch cost.
+
+
+struct TraceEvent
+{
+	LONGLONG ticks;
+	const char* name;
+	int arg;
+	char phase;
+};
+
+
+struct TraceBuffer
+{
+	DWORD threadId;
+	volatile LONG written;
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+
+volatile LONG tracingEnabled = 0;
+
+static __declspec(thread) TraceBuffer* threadBuffer = NULL;
+static std::vector<TraceBuffer*> traceBuffers;
+static critical_section traceBuffersLock;
+static LONGLONG traceStart = 0;
+
+//Names recorded from the host, kept for the life of the library
+static std::set<std::string> tracedNames;
+
+
+void traceRecord(const char* name, char phase, int arg)
+{
+	TraceBuffer* buffer = threadBuffer;
+	if (buffer == NULL)
+	{
+		buffer = new TraceBuffer();
+		buffer->threadId = GetCurrentThreadId();
+		buffer->written = 0;
+		critical_section::scoped_lock lock(traceBuffersLock);
+		traceBuffers.push_back(buffer);
+		threadBuffer = buffer;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	TraceEvent &e = buffer->events[buffer->written % TRACE_BUFFER_EVENTS];
+	e.ticks = now.QuadPart;
+	e.name = name;
+	e.arg = arg;
+	e.phase = phase;
+	buffer->written++;
+}
+
+
+int calcStartTrace()
+{
+	critical_section::scoped_lock lock(traceBuffersLock);
+	for (int i = 0; i < (int) traceBuffers.size(); i++)
+	{
+		traceBuffers[i]->written = 0;
+	}
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	traceStart = now.QuadPart;
+	InterlockedExchange(&tracingEnabled, 1);
+	return VIEWSHED_OK;
+}
+
+
+int calcStopTrace()
+{
+	InterlockedExchange(&tracingEnabled, 0);
+	return VIEWSHED_OK;
+}
+
+
+//An event from the host, such as its own worker threads
+int calcTraceMark(const char* name, char phase, int arg)
+{
+	if (name == NULL)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	if (tracingEnabled)
+	{
+		const char* interned;
+		{
+			critical_section::scoped_lock lock(traceBuffersLock);
+			interned = tracedNames.insert(name).first->c_str();
+		}
+		traceRecord(interned, phase, arg);
+	}
+	return VIEWSHED_OK;
+}
+
+
+void writeJsonString(std::ofstream &file, const char* text)
+{
+	file << '"';
+	for (const char* c = text; *c != 0; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			file << '\\';
+		}
+		if ((unsigned char) *c >= 32)
+		{
+			file << *c;
+		}
+	}
+	file << '"';
+}
+
+
+int calcWriteTrace(const char* path)
+{
+	if (path == NULL)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	double microseconds = 1000000.0 / frequency.QuadPart;
+	DWORD processId = GetCurrentProcessId();
+
+	std::ofstream file(path, std::ios::trunc);
+	file.precision(15);
+	file << "{\"traceEvents\":[\n";
+	bool first = true;
+
+	critical_section::scoped_lock lock(traceBuffersLock);
+	for (int b = 0; b < (int) traceBuffers.size(); b++)
+	{
+		const TraceBuffer &buffer = *traceBuffers[b];
+		LONG written = buffer.written;
+		for (LONG i = max(0, written - TRACE_BUFFER_EVENTS); i < written; i++)
+		{
+			const TraceEvent &e = buffer.events[i % TRACE_BUFFER_EVENTS];
+			file << (first ? "" : ",\n") << "{\"name\":";
+			writeJsonString(file, e.name);
+			file << ",\"ph\":\"" << e.phase << "\",\"ts\":" << (e.ticks - traceStart) * microseconds
+				<< ",\"pid\":" << processId << ",\"tid\":" << buffer.threadId << ",\"args\":{\"arg\":" << e.arg << "}}";
+			first = false;
+		}
+	}
+	file << "\n]}\n";
+	file.close();
+
+	return file.fail() ? VIEWSHED_IO_ERROR : VIEWSHED_OK;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingStartTrace()
+{
+	return calcStartTrace();
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingStopTrace()
+{
+	return calcStopTrace();
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingTraceBegin(const char* name, int arg)
+{
+	return calcTraceMark(name, 'B', arg);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingTraceEnd(const char* name, int arg)
+{
+	return calcTraceMark(name, 'E', arg);
+}
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingWriteTrace(const char* path)
+{
+	return calcWriteTrace(path);
+}
@@ -0,0 +1,357 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include "amp.h"
+#include <concrt.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+
+#define TUNING_FILE_NAME "ViewshedTuning.txt"
+
+//Pairs timed from each sample observer when tuning the line of sight chunk size
+#define TUNING_LOS_PAIRS 4096
+
+//Longest side of the window the XDRAW batch size is timed on, each observer's result is a
+//packed raster of the window
+#define TUNING_BATCH_WINDOW 512
+
+
+
+using namespace concurrency;
+
+
+//Autotuning: time the candidates on sample observers and remember the fastest
+//
+//The profile lives in TUNING_FILE_NAME beside the library and is read on first use. It holds
+//the fastest staging algorithm for each raster size class, floor(log2(cells)), plus the
+//XDRAW observer batch and line of sight chunk size. It is tied to the default accelerator's
+//device path, so a profile written on another card is ignored. Each tuning run replaces the
+//entry for its own size class and keeps the rest.
+
+
+static TuningProfile profile;
+static bool profileLoaded = false;
+static critical_section profileLock;
+
+
+std::string tuningDevice()
+{
+	std::wstring path = accelerator(accelerator::default_accelerator).device_path;
+	std::string narrow;
+	for (int i = 0; i < (int) path.size(); i++)
+	{
+		narrow += path[i] > 32 && path[i] < 127 ? (char) path[i] : '_';
+	}
+	return narrow;
+}
+
+
+std::string tuningPath()
+{
+	char modulePath[MAX_PATH] = "";
+	GetModuleFileNameA(libraryModule, modulePath, MAX_PATH);
+
+	std::string path(modulePath);
+	size_t slash = path.find_last_of("\\/");
+	return (slash == std::string::npos ? std::string() : path.substr(0, slash + 1)) + TUNING_FILE_NAME;
+}
+
+
+void defaultProfile(TuningProfile &p)
+{
+	for (int i = 0; i < TUNING_SIZE_CLASSES; i++)
+	{
+		p.algorithm[i] = 0;
+	}
+	p.xdrawObserverBatch = XDRAW_OBSERVER_BATCH;
+	p.losChunkSize = LOS_CHUNK_SIZE;
+}
+
+
+//Defaults, overridden by whatever the file holds for this device
+void readProfile(TuningProfile &p)
+{
+	defaultProfile(p);
+
+	std::ifstream file(tuningPath().c_str());
+	std::string line;
+	std::string device = tuningDevice();
+	TuningProfile read;
+	defaultProfile(read);
+	bool sameDevice = false;
+
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string key;
+		fields >> key;
+
+		if (key == "device")
+		{
+			std::string value;
+			fields >> value;
+			sameDevice = value == device;
+		}
+		else if (key == "xdrawObserverBatch")
+		{
+			fields >> read.xdrawObserverBatch;
+		}
+		else if (key == "losChunkSize")
+		{
+			fields >> read.losChunkSize;
+		}
+		else if (key == "algorithm")
+		{
+			int sizeClass = -1;
+			int gpuType = 0;
+			fields >> sizeClass >> gpuType;
+			if (sizeClass >= 0 && sizeClass < TUNING_SIZE_CLASSES)
+			{
+				read.algorithm[sizeClass] = gpuType;
+			}
+		}
+	}
+
+	if (sameDevice && read.xdrawObserverBatch > 0 && read.losChunkSize > 0)
+	{
+		p = read;
+	}
+}
+
+
+bool writeProfile(const TuningProfile &p)
+{
+	std::ofstream file(tuningPath().c_str());
+	file << "device " << tuningDevice() << "\n";
+	file << "xdrawObserverBatch " << p.xdrawObserverBatch << "\n";
+	file << "losChunkSize " << p.losChunkSize << "\n";
+	for (int i = 0; i < TUNING_SIZE_CLASSES; i++)
+	{
+		if (p.algorithm[i] != 0)
+		{
+			file << "algorithm " << i << " " << p.algorithm[i] << "\n";
+		}
+	}
+	return !file.fail();
+}
+
+
+//A copy, so a tuning run replacing the profile can't change it under the caller
+TuningProfile tuningProfile()
+{
+	critical_section::scoped_lock lock(profileLock);
+	if (!profileLoaded)
+	{
+		readProfile(profile);
+		profileLoaded = true;
+	}
+	return profile;
+}
+
+
+int sizeClass(int rasterWidth, int rasterHeight)
+{
+	long long cells = (long long) rasterWidth * rasterHeight;
+	int c = 0;
+	while (c + 1 < TUNING_SIZE_CLASSES && (2LL << c) <= cells)
+	{
+		c++;
+	}
+	return c;
+}
+
+
+//Fastest algorithm tuned for the nearest size class, DDA_EXACT if nothing is tuned
+int tunedAlgorithm(int rasterWidth, int rasterHeight)
+{
+	TuningProfile p = tuningProfile();
+	int c = sizeClass(rasterWidth, rasterHeight);
+
+	for (int d = 0; d < TUNING_SIZE_CLASSES; d++)
+	{
+		if (c - d >= 0 && p.algorithm[c - d] != 0)
+		{
+			return p.algorithm[c - d];
+		}
+		if (c + d < TUNING_SIZE_CLASSES && p.algorithm[c + d] != 0)
+		{
+			return p.algorithm[c + d];
+		}
+	}
+	return DDA_EXACT;
+}
+
+
+double secondsSince(const LARGE_INTEGER &start)
+{
+	LARGE_INTEGER now;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (double) (now.QuadPart - start.QuadPart) / frequency.QuadPart;
+}
+
+
+//Seconds to run every sample observer with one staging algorithm, after a warm up run that
+//pays for shader compilation
+double timeAlgorithm(int handle, float* zBuffer, int* visibleBuffer, int cells, int gpuType,
+	int* sampleX, int* sampleY, int* sampleZ, int sampleCount)
+{
+	memset(visibleBuffer, 0, cells * sizeof(int));
+	calcBuffered(handle, sampleX[0], sampleY[0], sampleZ[0], gpuType, NULL);
+
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < sampleCount; i++)
+	{
+		memset(visibleBuffer, 0, cells * sizeof(int));
+		calcBuffered(handle, sampleX[i], sampleY[i], sampleZ[i], gpuType, NULL);
+	}
+	return secondsSince(start);
+}
+
+
+//Benchmarks staging's algorithms, the batched XDRAW batch size and the line of sight chunk
+//size on the sample observers (absolute heights, as staging's currZ) and saves the winners
+//into the profile, which later AUTO runs pick up. chosenAlgorithm receives this raster's pick.
+int calcAutotune(float* zArray, int rasterWidth, int rasterHeight, int* sampleX, int* sampleY, int* sampleZ,
+	int sampleCount, int* chosenAlgorithm)
+{
+	if (rasterWidth < 3 || rasterHeight < 3 || sampleCount <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	for (int i = 0; i < sampleCount; i++)
+	{
+		//XDRAW seeds the ring of neighbours round the observer
+		if (sampleX[i] < 1 || sampleX[i] >= rasterWidth - 1 || sampleY[i] < 1 || sampleY[i] >= rasterHeight - 1)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	TuningProfile tuned = tuningProfile();
+	int cells = rasterWidth * rasterHeight;
+
+	//Algorithms
+	float* zBuffer;
+	int* visibleBuffer;
+	int handle = calcCreateBuffers(rasterWidth, rasterHeight, 0, &zBuffer, &visibleBuffer, NULL);
+	if (handle < 0)
+	{
+		return handle;
+	}
+	memcpy(zBuffer, zArray, cells * sizeof(float));
+
+	int candidates[] = { XDRAW, DDA, R3, DDA_EXACT };
+	int best = DDA_EXACT;
+	double bestTime = 0.0;
+	for (int c = 0; c < 4; c++)
+	{
+		double t = timeAlgorithm(handle, zBuffer, visibleBuffer, cells, candidates[c], sampleX, sampleY, sampleZ, sampleCount);
+		if (c == 0 || t < bestTime)
+		{
+			best = candidates[c];
+			bestTime = t;
+		}
+	}
+	calcFreeBuffers(handle);
+	tuned.algorithm[sizeClass(rasterWidth, rasterHeight)] = best;
+
+	//Batched XDRAW, with enough observers to fill the largest batch twice. Their packed results
+	//would take observerCount rasters, so it is timed on a window of the DEM round the first
+	//sample, with the samples moved into it.
+	int batchCandidates[] = { 16, 32, 64, 128 };
+	int observerCount = 2 * batchCandidates[3];
+	int windowWidth = min(rasterWidth, TUNING_BATCH_WINDOW);
+	int windowHeight = min(rasterHeight, TUNING_BATCH_WINDOW);
+	int windowX = max(0, min(sampleX[0] - windowWidth / 2, rasterWidth - windowWidth));
+	int windowY = max(0, min(sampleY[0] - windowHeight / 2, rasterHeight - windowHeight));
+	std::vector<float> window((size_t) windowWidth * windowHeight);
+	for (int y = 0; y < windowHeight; y++)
+	{
+		memcpy(&window[(size_t) y * windowWidth], &zArray[(size_t) (windowY + y) * rasterWidth + windowX], windowWidth * sizeof(float));
+	}
+
+	std::vector<int> batchX(observerCount);
+	std::vector<int> batchY(observerCount);
+	std::vector<int> batchZ(observerCount);
+	for (int i = 0; i < observerCount; i++)
+	{
+		batchX[i] = max(0, min(sampleX[i % sampleCount] - windowX, windowWidth - 1));
+		batchY[i] = max(0, min(sampleY[i % sampleCount] - windowY, windowHeight - 1));
+		batchZ[i] = sampleZ[i % sampleCount];
+	}
+	std::vector<unsigned int> bits((size_t) observerCount * ((windowWidth * windowHeight + 31) / 32));
+
+	calcXdrawBatch(window.data(), windowWidth, windowHeight, batchX.data(), batchY.data(), batchZ.data(), batchCandidates[0],
+		batchCandidates[0], bits.data());
+	for (int c = 0; c < 4; c++)
+	{
+		LARGE_INTEGER start;
+		QueryPerformanceCounter(&start);
+		calcXdrawBatch(window.data(), windowWidth, windowHeight, batchX.data(), batchY.data(), batchZ.data(), observerCount,
+			batchCandidates[c], bits.data());
+		double t = secondsSince(start);
+		if (c == 0 || t < bestTime)
+		{
+			tuned.xdrawObserverBatch = batchCandidates[c];
+			bestTime = t;
+		}
+	}
+
+	//Line of sight chunks, each sample to targets spread over the raster
+	int chunkCandidates[] = { 256, 1024, 4096 };
+	int pairCount = sampleCount * TUNING_LOS_PAIRS;
+	std::vector<int> observerX(pairCount);
+	std::vector<int> observerY(pairCount);
+	std::vector<int> targetX(pairCount);
+	std::vector<int> targetY(pairCount);
+	std::vector<float> heights(pairCount, 0.0f);
+	std::vector<int> visible(pairCount);
+	std::vector<float> clearance(pairCount);
+	for (int i = 0; i < pairCount; i++)
+	{
+		int n = i % TUNING_LOS_PAIRS;
+		observerX[i] = sampleX[i / TUNING_LOS_PAIRS];
+		observerY[i] = sampleY[i / TUNING_LOS_PAIRS];
+		targetX[i] = (int) ((long long) n * 7919 % rasterWidth);
+		targetY[i] = (int) ((long long) n * 104729 % rasterHeight);
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		LARGE_INTEGER start;
+		QueryPerformanceCounter(&start);
+		calcLineOfSight(zArray, rasterWidth, rasterHeight, observerX.data(), observerY.data(), heights.data(),
+			targetX.data(), targetY.data(), heights.data(), pairCount, 0, chunkCandidates[c], visible.data(), clearance.data());
+		double t = secondsSince(start);
+		if (c == 0 || t < bestTime)
+		{
+			tuned.losChunkSize = chunkCandidates[c];
+			bestTime = t;
+		}
+	}
+
+	if (chosenAlgorithm != NULL)
+	{
+		*chosenAlgorithm = best;
+	}
+
+	critical_section::scoped_lock lock(profileLock);
+	profile = tuned;
+	profileLoaded = true;
+	return writeProfile(profile) ? VIEWSHED_OK : VIEWSHED_IO_ERROR;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingAutotune(float* zArray, int rasterWidth, int rasterHeight, int* sampleX, int* sampleY, int* sampleZ,
+	int sampleCount, int* chosenAlgorithm)
+{
+	return calcAutotune(zArray, rasterWidth, rasterHeight, sampleX, sampleY, sampleZ, sampleCount, chosenAlgorithm);
+}
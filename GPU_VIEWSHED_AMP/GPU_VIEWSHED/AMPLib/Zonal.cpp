@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "AMPLib.h"
+#include "amp.h"
+#include <vector>
+
+
+//Tile of the zone reduction, ZONAL_TILE x ZONAL_TILE cells over rows and columns, so the
+//65535 tile dispatch limit is per axis (about a million cells a side) rather than on the cell count
+#define ZONAL_TILE 16
+#define ZONAL_TILE_CELLS (ZONAL_TILE * ZONAL_TILE)
+
+//Most zones counted in tile_static memory, more go straight to the global counts
+#define ZONAL_TILE_ZONES 1024
+
+
+
+using namespace concurrency;
+
+
+//Zonal coverage: visible cells per zone for each observer, without reading visibility back
+//
+//zoneArray labels every cell with a zone id in [0, zoneCount), anything else belongs to no zone.
+//Each observer's exact DDA viewshed stays on the accelerator and is reduced there into one row
+//of per-zone counts: each tile counts its cells in tile_static memory and adds the non-zero
+//totals to the row with one atomic per zone, so only observerCount * zoneCount integers come
+//back. With more zones than fit in a tile, cells add to the row directly.
+
+
+//Add the visible cells of each zone to row observer of dataViewCounts
+void countZones(accelerator_view av, const array_view<const int, 2> &dataViewVisible, const array_view<const int, 1> &dataViewZones,
+	const array_view<int, 2> &dataViewCounts, int observer, int zoneCount, int rasterWidth, int rasterHeight)
+{
+	if (zoneCount > ZONAL_TILE_ZONES)
+	{
+		parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+		{
+			int zone = dataViewZones(idx[0] * rasterWidth + idx[1]);
+			if (zone >= 0 && zone < zoneCount && dataViewVisible[idx] != 0)
+			{
+				atomic_fetch_add(&dataViewCounts(observer, zone), 1);
+			}
+		});
+		return;
+	}
+
+	parallel_for_each(av, dataViewVisible.get_extent().tile<ZONAL_TILE, ZONAL_TILE>().pad(),
+		[=](tiled_index<ZONAL_TILE, ZONAL_TILE> t) restrict(amp)
+	{
+		int lane = t.local[0] * ZONAL_TILE + t.local[1];
+
+		tile_static int tileCounts[ZONAL_TILE_ZONES];
+		for (int z = lane; z < zoneCount; z += ZONAL_TILE_CELLS)
+		{
+			tileCounts[z] = 0;
+		}
+		t.barrier.wait();
+
+		int y = t.global[0];
+		int x = t.global[1];
+		if (y < rasterHeight && x < rasterWidth)
+		{
+			int zone = dataViewZones(y * rasterWidth + x);
+			if (zone >= 0 && zone < zoneCount && dataViewVisible(y, x) != 0)
+			{
+				atomic_fetch_add(&tileCounts[zone], 1);
+			}
+		}
+		t.barrier.wait();
+
+		for (int z = lane; z < zoneCount; z += ZONAL_TILE_CELLS)
+		{
+			if (tileCounts[z] != 0)
+			{
+				atomic_fetch_add(&dataViewCounts(observer, z), tileCounts[z]);
+			}
+		}
+	});
+}
+
+
+//zoneCounts receives observerCount rows of zoneCount visible cell counts. zoneAreas may be null,
+//otherwise it receives the same counts times cellArea. job may be null, otherwise it is checked
+//between observers; a stopped job's rows past job->completed are left at 0.
+int calcZonalViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int* zoneArray, int zoneCount, double cellArea, int* zoneCounts, double* zoneAreas, ViewshedJob* job)
+{
+	if (zoneArray == NULL || zoneCounts == NULL || zoneCount <= 0 || observerCount <= 0)
+	{
+		return VIEWSHED_BAD_ARGUMENT;
+	}
+	for (int i = 0; i < observerCount; i++)
+	{
+		if (observerX[i] < 0 || observerX[i] >= rasterWidth || observerY[i] < 0 || observerY[i] >= rasterHeight)
+		{
+			return VIEWSHED_BAD_ARGUMENT;
+		}
+	}
+
+	accelerator device = exactAccelerator();
+	accelerator_view av = device.default_view;
+
+	int cellCount = rasterWidth * rasterHeight;
+
+	//Resident for every observer, only the counts come back
+	array<float, 2> zResident(rasterHeight, rasterWidth, zArray, zArray + cellCount, av);
+	array<int, 1> zonesResident(cellCount, zoneArray, zoneArray + cellCount, av);
+	array<int, 2> visibleResident(rasterHeight, rasterWidth, av);
+	array<int, 2> countsResident(observerCount, zoneCount, av);
+
+	const array_view<const float, 2> dataViewZ(zResident);
+	const array_view<const int, 1> dataViewZones(zonesResident);
+	array_view<int, 2> dataViewVisible(visibleResident);
+	array_view<int, 2> dataViewCounts(countsResident);
+
+	parallel_for_each(av, dataViewCounts.get_extent(), [=](index<2> idx) restrict(amp)
+	{
+		dataViewCounts[idx] = 0;
+	});
+
+	ULONGLONG startTicks = GetTickCount64();
+	int status = VIEWSHED_OK;
+
+	for (int i = 0; i < observerCount; i++)
+	{
+		jobProgress(job, i, observerCount);
+		status = jobStatus(job, startTicks);
+		if (status != VIEWSHED_OK)
+		{
+			break;
+		}
+
+		TraceScope trace("zonal observer", i);
+		int currX = observerX[i];
+		int currY = observerY[i];
+
+		parallel_for_each(av, dataViewVisible.get_extent(), [=](index<2> idx) restrict(amp)
+		{
+			dataViewVisible[idx] = (idx[0] == currY && idx[1] == currX) ? 1 : 0;
+		});
+
+		traceAllRaysExact(av, dataViewZ, dataViewVisible, currX, currY, observerZ[i], rasterWidth, rasterHeight);
+		countZones(av, dataViewVisible, dataViewZones, dataViewCounts, i, zoneCount, rasterWidth, rasterHeight);
+	}
+
+	copy(countsResident, zoneCounts);
+
+	if (zoneAreas != NULL)
+	{
+		for (int i = 0; i < observerCount * zoneCount; i++)
+		{
+			zoneAreas[i] = zoneCounts[i] * cellArea;
+		}
+	}
+
+	if (status == VIEWSHED_OK)
+	{
+		jobProgress(job, observerCount, observerCount);
+	}
+	return status;
+}
+
+
+
+extern "C" __declspec (dllexport)
+	int _stdcall stagingZonalViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+	int observerCount, int* zoneArray, int zoneCount, double cellArea, int* zoneCounts, double* zoneAreas, ViewshedJob* job)
+{
+	return calcZonalViewshed(zArray, rasterWidth, rasterHeight, observerX, observerY, observerZ, observerCount,
+		zoneArray, zoneCount, cellArea, zoneCounts, zoneAreas, job);
+}
@@ -36,21 +36,195 @@ public class ViewshedAddIn : IAddIn
         extern unsafe static void staging(float* zaArray, int zArrayLengthX, int zArrayLengthY, int* visibleArray,
             int visibleArrayX, int visibleArrayY, int currX, int currY, int currZ, int rasterWidth, int rasterHeight, float* losArrayPt, int g);
 
+        //Viewsheds along a path of observer positions, mode 1 = union, 2 = count, 3 = packed bitmap per position
+        //angularTolerance 0 traces every position in full, above 0 keeps rays whose horizon moved less than that (radians)
+        //cellSize converts the observer's height changes to cells when judging how far it moved
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingPath(float* zArray, int rasterWidth, int rasterHeight, float cellSize, int* pathX, int* pathY, int* pathZ,
+            int pathLength, float angularTolerance, int* outputArray, int outputMode);
+
+        //Estimated visible cell count for every cell as an observer, a float area in cells, maxRadius 0 = unlimited
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingTotal(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float targetHeight,
+            float maxRadius, int sectorCount, float* countArray);
+
+        //Point to point visibility and clearance for batches of observer/target pairs
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingLineOfSight(float* zArray, int rasterWidth, int rasterHeight,
+            int* observerX, int* observerY, float* observerHeight, int* targetX, int* targetY, float* targetHeight,
+            int pairCount, int stopAtFirstObstruction, int* visibleArray, float* clearanceArray);
+
+        //Exact DDA plus per-cell horizon angle (radians) and minimum visible target height, outputs may be null
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingHorizon(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+            int* visibleArray, float* horizonArray, float* minHeightArray);
+
+        //Greedy maximum coverage siting of siteCount observers from the candidate list
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingSiting(float* zArray, int rasterWidth, int rasterHeight, int* candidateX, int* candidateY, int* candidateZ,
+            int candidateCount, int siteCount, int* chosenSites, int* coverageCurve, int* chosenCount);
+
+        //Per-cell visibility probability over seeded realisations of correlated DEM error
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingProbabilistic(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+            int realisations, float errorSigma, int correlationLength, uint seed, float* probabilityArray);
+
+        //Patch DDA_EXACT visibility rasters in place after the DEM changed inside the edit box
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingPatch(float* zArray, int rasterWidth, int rasterHeight, int editMinX, int editMinY, int editMaxX, int editMaxY,
+            int* observerX, int* observerY, int* observerZ, int observerCount, int* visibleArrays, int* changedCounts);
+
+        //Hours of sun per cell over a batch of sun positions (radians, azimuth clockwise from north)
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingSunHours(float* zArray, int rasterWidth, int rasterHeight, float cellSize,
+            float* sunAzimuth, float* sunElevation, float* positionHours, int positionCount, float* sunHoursArray);
+
+        //Build or resume a horizon profile index file, then load it and answer approximate visibility from it
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingBuildHorizonIndex(float* zArray, int rasterWidth, int rasterHeight, float observerHeight, float cellSize,
+            int sectorCount, int maxRadius, string indexPath);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingLoadHorizonIndex(string indexPath);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingQueryHorizonIndex(int handle, int* observerX, int* observerY, int* targetX, int* targetY,
+            float* targetHeight, int queryCount, int* visibleArray);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingHorizonIndexViewshed(int handle, int currX, int currY, float targetHeight, int* visibleArray);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingFreeHorizonIndex(int handle);
+
+        //Approximate viewshed reading coarser DEM levels with distance, optionally counting cells that differ from DDA_EXACT
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingLevelOfDetail(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+            float angularTolerance, int* visibleArray, int* mismatchCount);
+
+        //Coarse preview then exact tiles nearest the observer first, progress through the cursor and/or callback.
+        //The callback gets the rectangle just written; tileOrder, if not null, the row major tile indices in order.
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        delegate void ProgressCallback(int tilesDone, int tileCount, int originX, int originY, int width, int height);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingProgressive(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+            int coarseLevel, int tileSize, int* visibleArray, int* progressCursor, int* tileOrder,
+            ProgressCallback onProgress, ViewshedJob* job);
+
+        //Cancellation flag, time budget and progress shared with a running job
+        [StructLayout(LayoutKind.Sequential)]
+        struct ViewshedJob
+        {
+            public int cancelRequested;
+            public int timeBudgetMs;
+            public int completed;
+            public int total;
+        }
+
+        //staging that can be cancelled or timed out through job, returns a status
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingJob(float* zArray, int zArrayLengthX, int zArrayLengthY, int* visibleArray, int visibleArrayX, int visibleArrayY,
+            int currX, int currY, int currZ, int rasterWidth, int rasterHeight, float* losArray, int gpuType, ViewshedJob* job);
+
+        //Library owned DEM and visibility rasters the host fills and reads in place, with private XDRAW scratch
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingCreateBuffers(int rasterWidth, int rasterHeight, int useLargePages, float** zArray, int** visibleArray,
+            int* usedLargePages);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingBuffered(int handle, int currX, int currY, int currZ, int gpuType, ViewshedJob* job);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingFreeBuffers(int handle);
+
+        //XDRAW for many observers, a ring of the whole batch per dispatch, one packed bitmap per observer
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingXdrawBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+            int observerCount, uint* visibleBits);
+
+        //Time the algorithms and sizes on sample observers and save the fastest to the tuning profile used by AUTO
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingAutotune(float* zArray, int rasterWidth, int rasterHeight, int* sampleX, int* sampleY, int* sampleZ,
+            int sampleCount, int* chosenAlgorithm);
+
+        //staging memoised in cacheDir, keyed by the DEM contents, observer and algorithm, LRU bounded to maxCacheBytes.
+        //Only visibility is cached, losArray is untouched on a hit.
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingCached(float* zArray, int rasterWidth, int rasterHeight, int* visibleArray, float* losArray,
+            int currX, int currY, int currZ, int gpuType, string cacheDir, long maxCacheBytes, ViewshedJob* job, int* cacheHit);
+
+        //DEM sheets read through a shared LRU tile cache, viewsheds on the window round an observer in the sheets' grid
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingOpenMosaic(string[] sheetPaths, int* originX, int* originY, int* sheetWidth, int* sheetHeight,
+            int sheetCount, int tileSize, int maxCachedTiles);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingMosaicViewshed(int handle, int currX, int currY, int currZ, int radius, int gpuType, int* visibleArray,
+            ViewshedJob* job);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingCloseMosaic(int handle);
+
+        //Cumulative viewshed of an observer list sharded across worker processes sharing a job directory, resumable
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingPrepareBatch(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+            int observerCount, int shardObservers, string jobDir);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingRunBatch(string jobDir, int workerCount);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingMergeBatch(string jobDir, int* cumulativeArray);
+
+        //Tiled LZW compressed cloud optimised GeoTIFF, sampleType 1 byte and 2 int32 from an int raster, 3 float32 from a float raster
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingWriteGeoTiff(string path, void* raster, int rasterWidth, int rasterHeight, int sampleType,
+            double* geoTransform, int epsg, int tileSize);
+
+        //Timeline tracing dumped as Chrome trace event JSON, begin and end mark the host's own events
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingStartTrace();
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingStopTrace();
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingTraceBegin(string name, int arg);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingTraceEnd(string name, int arg);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingWriteTrace(string path);
+
+        //Exact CPU cumulative viewshed with workers pinned per NUMA node, placement 1 replicates the DEM per node, 2 interleaves it
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingNumaViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+            int observerCount, int placement, int* cumulativeArray, ViewshedJob* job);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingNumaTopology(int* nodeCount, int* nodeProcessors, int maxNodes);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingNumaBandwidth(double* nodeGigabytesPerSecond, int maxNodes);
+
+        //Bare DEM kept resident, with per run obstruction bytes (times obstructionScale metres) and target heights, either may be null
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingOpenLayeredDem(float* zArray, int rasterWidth, int rasterHeight);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingLayeredViewshed(int handle, int currX, int currY, int currZ, byte* obstructionArray,
+            float obstructionScale, float* targetHeightArray, int* visibleArray);
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern static int stagingCloseLayeredDem(int handle);
+
+        //XDRAW with its compass lines seeded in the library, optionally counting cells that differ from DDA_EXACT
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingValidateXdraw(float* zArray, int rasterWidth, int rasterHeight, int currX, int currY, int currZ,
+            int* visibleArray, int* mismatchCount);
+
+        //Visible cells (and area, cellArea each) per zone of zoneArray for each observer, reduced in the engine so no visibility comes back
+        [DllImport("AMPLib", CallingConvention = CallingConvention.StdCall)]
+        extern unsafe static int stagingZonalViewshed(float* zArray, int rasterWidth, int rasterHeight, int* observerX, int* observerY, int* observerZ,
+            int observerCount, int* zoneArray, int zoneCount, double cellArea, int* zoneCounts, double* zoneAreas, ViewshedJob* job);
+
 
 
-        //Array of heights for each pixel
-        static double[,] zArray;
-        static float[,] zArrayFloat;
+        //Heights and GPU visibility for each pixel, owned by the library and filled in place, see stagingCreateBuffers
+        static int sharedBuffers = -1;
+        static unsafe float* zArrayShared;
+        static unsafe int* visibleArrayShared;
 
-        //Array for the XDraw LOS values for each pixel
+        //Array for the XDraw LOS values for each pixel, CPU XDRAW only
         static float[,] losArray;
 
-        //Array of visible pixels to be parsed out
-        static bool[,] visibleArray;
-        static int[,] visibleArrayInt;
+        //Array of visible pixels found by the CPU algorithms
         static int[,] visibleArrayCPU;
 
-        //Array of vertices which have been visited
+        //Array of vertices which have been visited, CPU R2 only
         static bool[,] visitedArray;
 
         //Array of previous Lines of Sights for the Octants calculation
@@ -132,14 +306,7 @@ public IDataset Execute(IApplication application)
             rasterWidth = demRaster.GetVertexIndexCount(0);
             rasterHeight = demRaster.GetVertexIndexCount(1);
 
-            zArray = new double[rasterHeight, rasterWidth];
-            zArrayFloat = new float[rasterHeight, rasterWidth];
-            visibleArray = new bool[rasterHeight, rasterWidth];
-            visibleArrayInt = new int[rasterHeight, rasterWidth];
-            visibleArrayCPU = new int[rasterHeight, rasterWidth];
-            losArray = new float[rasterHeight, rasterWidth];
-
-            visitedArray = new bool[rasterHeight, rasterWidth];
+            createSharedBuffers();
 
 
 
@@ -219,7 +386,7 @@ public IDataset Execute(IApplication application)
                 for (int i = 0; i < spanSize; ++i)
                 {
                     //  zArray[windowOfsY, windowOfsX + i] = demVertexTable[rasterIndex + i].Z;
-                    zArrayFloat[windowOfsY, windowOfsX + i] = (float)demVertexTable[rasterIndex + i].Z;
+                    setHeight(windowOfsY, windowOfsX + i, (float)demVertexTable[rasterIndex + i].Z);
                 }
             });
 
@@ -390,7 +557,8 @@ public IDataset Execute(IApplication application)
 
                 for (int i = 0; i < spanSize; ++i)
                 {
-                    demVertexTable[rasterIndex + i].VisibleInt = visibleArrayCPU[windowOfsY, windowOfsX + i] + visibleArrayInt[windowOfsY, windowOfsX + i];
+                    demVertexTable[rasterIndex + i].VisibleInt = (visibleArrayCPU != null ? visibleArrayCPU[windowOfsY, windowOfsX + i] : 0)
+                        + visibleAt(windowOfsY, windowOfsX + i);
                   //  if (visibleArrayCPU[windowOfsY, windowOfsX + i] + visibleArrayInt[windowOfsY, windowOfsX + i] > 0)
                     //{
                       //  vp.setVisiblePoints(1);
@@ -406,6 +574,8 @@ public IDataset Execute(IApplication application)
             Trace.WriteLine("Visible/Total points: " + visiblePoints + " / " + totalPoints);
             Trace.WriteLine("Percentage of total: " + (float)((float)visiblePoints / (float)totalPoints) * 100);
             Trace.WriteLine("CPU Viewsheds processed: " + _totalCPU + " GPU Viewsheds processed: " + _totalGPU);
+            stagingFreeBuffers(sharedBuffers);
+            sharedBuffers = -1;
             return application.InputDatasets[0];
         }
 
@@ -421,7 +591,9 @@ static void ProcessQueueCPU()
                 {
                     FocalPointStruct f = _stack.Pop();
                     Trace.WriteLine("Processing CPU focii" + f.x + " " + f.y + " " + f.z + " on thread " + Thread.CurrentThread.ManagedThreadId);
+                    stagingTraceBegin("cpu observer", f.x);
                     calculateXDRAW(f.x, f.y, f.z);
+                    stagingTraceEnd("cpu observer", f.x);
                     _totalCPU++;
 
                 }
@@ -436,7 +608,9 @@ static void ProcessQueueGPU()
                 {
                     FocalPointStruct f = _stack.Pop();
                     Trace.WriteLine("Processing GPU focii" + f.x + " " + f.y + " " + f.z + " on thread " + Thread.CurrentThread.ManagedThreadId);
+                    stagingTraceBegin("gpu observer", f.x);
                     callGPU(f.x, f.y, f.z, "XDRAW");
+                    stagingTraceEnd("gpu observer", f.x);
                     _totalGPU++;
 
                 }
@@ -449,125 +623,17 @@ private static unsafe void callGPU(int currX, int currY, int currZ, string gpuTy
         {
             //which gpu option to choose
             int g = 1;
-            //set start point as visible
-            visibleArrayInt[currY, currX] = 1;
 
-            //Determine which GPU method to run
+            //Determine which GPU method to run, the library seeds XDRAW's compass lines itself
             if (gpuType == "XDRAW")
             {
-                int destX, destY;
                 g = 1;
                 viewshedType = " GPU - XDRAW ";
-
-                // Precaculate the 8 compass points for use in losArray
-                preCalculateDDA(currX, currY, currZ, currX, rasterHeight - 1);
-                preCalculateDDA(currX, currY, currZ, currX, 0);
-
-                preCalculateDDA(currX, currY, currZ, 0, currY);
-                preCalculateDDA(currX, currY, currZ, rasterWidth - 1, currY);
-
-
-                //NW
-                destX = currX - (rasterHeight - currY);
-                destY = rasterHeight - 1;
-                if (destX <= 0)
-                {
-                    destY = rasterHeight + destX - 1;
-                    destX = 0;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-
-                //SE
-                destX = currX + (rasterHeight - (rasterHeight - currY));
-                destY = 0;
-                if (destX >= rasterWidth - 1)
-                {
-                    destY = (destX - rasterWidth - 1);
-                    destX = rasterWidth - 1;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-                //SW
-                destX = currX - (rasterHeight - (rasterHeight - currY));
-                destY = 0;
-                if (destX <= 0)
-                {
-                    destY = rasterHeight - (rasterHeight + destX - 1);
-                    destX = 0;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-                visibleArrayInt[currY - 1, currX] = 1;
-                visibleArrayInt[currY + 1, currX] = 1;
-                visibleArrayInt[currY + 1, currX + 1] = 1;
-                visibleArrayInt[currY, currX + 1] = 1;
-                visibleArrayInt[currY - 1, currX + 1] = 1;
-                visibleArrayInt[currY, currX - 1] = 1;
-                visibleArrayInt[currY + 1, currX - 1] = 1;
-                visibleArrayInt[currY - 1, currX - 1] = 1;
             }
             else if (gpuType == "SDRAW")
             {
-                int destX, destY;
                 g = 2;
                 viewshedType = " GPU - SDRAW";
-
-                // Precaculate the 8 compass points for use in losArray
-                preCalculateDDA(currX, currY, currZ, currX, rasterHeight - 1);
-                preCalculateDDA(currX, currY, currZ, currX, 0);
-
-                preCalculateDDA(currX, currY, currZ, 0, currY);
-                preCalculateDDA(currX, currY, currZ, rasterWidth - 1, currY);
-
-
-                //NW
-                destX = currX - (rasterHeight - currY);
-                destY = rasterHeight - 1;
-                if (destX <= 0)
-                {
-                    destY = rasterHeight + destX - 1;
-                    destX = 0;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-
-                //SE
-                destX = currX + (rasterHeight - (rasterHeight - currY));
-                destY = 0;
-                if (destX >= rasterWidth - 1)
-                {
-                    destY = (destX - rasterWidth - 1);
-                    destX = rasterWidth - 1;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-                //SW
-                destX = currX - (rasterHeight - (rasterHeight - currY));
-                destY = 0;
-                if (destX <= 0)
-                {
-                    destY = rasterHeight - (rasterHeight + destX - 1);
-                    destX = 0;
-                }
-                preCalculateDDA(currX, currY, currZ, destX, destY);
-
-
-                visibleArrayInt[currY - 1, currX] = 1;
-                visibleArrayInt[currY + 1, currX] = 1;
-                visibleArrayInt[currY + 1, currX + 1] = 1;
-                visibleArrayInt[currY, currX + 1] = 1;
-                visibleArrayInt[currY - 1, currX + 1] = 1;
-                visibleArrayInt[currY, currX - 1] = 1;
-                visibleArrayInt[currY + 1, currX - 1] = 1;
-                visibleArrayInt[currY - 1, currX - 1] = 1;
-
-
             }
             else if (gpuType == "DDA")
             {
@@ -584,23 +650,75 @@ private static unsafe void callGPU(int currX, int currY, int currZ, string gpuTy
                 g = 5;
                 viewshedType = " GPU - R2";
             }
+            else if (gpuType == "DDA_EXACT")
+            {
+                g = 6;
+                viewshedType = " GPU - DDA EXACT";
+            }
+            else if (gpuType == "AUTO")
+            {
+                g = 7;
+                viewshedType = " GPU - AUTO";
+            }
 
 
             //Start Timing
             // stopwatch.Start();
 
-            fixed (int* visibleArrayPt = &visibleArrayInt[0, 0])
-            fixed (float* zArrayPt = &zArrayFloat[0, 0])
-            fixed (float* losArrayPt = &losArray[0, 0])
-                staging(zArrayPt, zArray.GetLength(1), zArray.GetLength(0),
-                    visibleArrayPt, visibleArrayInt.GetLength(1), visibleArrayInt.GetLength(0),
-                    currX, currY, currZ, rasterWidth, rasterHeight, losArrayPt, g);
+            //Runs on the shared buffers in place, nothing to pin or copy
+            stagingBuffered(sharedBuffers, currX, currY, currZ, g, null);
 
             //Stop Timing
             // stopwatch.Stop();
 
         }
 
+        //Library owned DEM and visibility rasters, the host writes heights and reads visibility through them
+        private static unsafe void createSharedBuffers()
+        {
+            float* zArray;
+            int* visibleArray;
+            int usedLargePages;
+            sharedBuffers = stagingCreateBuffers(rasterWidth, rasterHeight, 1, &zArray, &visibleArray, &usedLargePages);
+            if (sharedBuffers < 0)
+            {
+                throw new AddInException("Could not allocate the raster buffers.");
+            }
+            zArrayShared = zArray;
+            visibleArrayShared = visibleArray;
+        }
+
+        private static unsafe void setHeight(int y, int x, float z)
+        {
+            zArrayShared[y * rasterWidth + x] = z;
+        }
+
+        private static unsafe float heightAt(int y, int x)
+        {
+            return zArrayShared[y * rasterWidth + x];
+        }
+
+        private static unsafe void markVisible(int y, int x)
+        {
+            visibleArrayShared[y * rasterWidth + x] = 1;
+        }
+
+        private static unsafe int visibleAt(int y, int x)
+        {
+            return visibleArrayShared[y * rasterWidth + x];
+        }
+
+        //Rasters only the CPU algorithms use, allocated the first time one runs
+        private static void createCPURasters()
+        {
+            if (visibleArrayCPU == null)
+            {
+                visibleArrayCPU = new int[rasterHeight, rasterWidth];
+                losArray = new float[rasterHeight, rasterWidth];
+                visitedArray = new bool[rasterHeight, rasterWidth];
+            }
+        }
+
         static private void preCalculateDDA(int focalX, int focalY, int focalZ, int destinationX, int destinationY)
         {
 
@@ -637,7 +755,7 @@ static private void preCalculateDDA(int focalX, int focalY, int focalZ, int dest
             yIncrement = dy / (float)steps;
 
             //first point is visible
-            visibleArrayInt[(int)y, (int)x] = 1;
+            markVisible((int)y, (int)x);
 
             //traverse through the line step by step
             for (int k = 0; k < steps; k++)
@@ -651,7 +769,7 @@ static private void preCalculateDDA(int focalX, int focalY, int focalZ, int dest
                 float dist = (float)Math.Sqrt((x - focalX) * (x - focalX) + (y - focalY) * (y - focalY));
 
                 //Elevation to check point
-                float elev = (zArrayFloat[(int)y, (int)x] - focalZ) / dist;
+                float elev = (heightAt((int)y, (int)x) - focalZ) / dist;
 
                 //elevation check
                 if (elev > highest)
@@ -672,6 +790,7 @@ static private void preCalculateDDA(int focalX, int focalY, int focalZ, int dest
 
         private void callDDA()
         {
+            createCPURasters();
             viewshedType = "CPU - DDA";
             stopwatch.Start();
             int x = 0;
@@ -707,6 +826,7 @@ private void callDDA()
 
         private void callR3()
         {
+            createCPURasters();
             viewshedType = "CPU - R3";
             stopwatch.Start();
             int x = 0;
@@ -742,6 +862,7 @@ private void callR3()
 
         private void callR2()
         {
+            createCPURasters();
             viewshedType = "CPU - R2";
             stopwatch.Start();
             int x = 0;
@@ -810,7 +931,7 @@ private void calculateDDA(int focalX, int focalY, int focalZ, int destinationX,
             yIncrement = dy / (float)steps;
 
             //first point is visible
-            visibleArrayInt[(int)y, (int)x] = 1;
+            markVisible((int)y, (int)x);
 
             //traverse through the line step by step
             for (int k = 0; k < steps; k++)
@@ -824,7 +945,7 @@ private void calculateDDA(int focalX, int focalY, int focalZ, int destinationX,
                 float dist = (float)Math.Sqrt((x - focalX) * (x - focalX) + (y - focalY) * (y - focalY));
 
                 //Elevation to check point
-                float elev = (zArrayFloat[(int)y, (int)x] - focalZ) / dist;
+                float elev = (heightAt((int)y, (int)x) - focalZ) / dist;
 
                 //elevation check
                 if (elev > highest)
@@ -875,7 +996,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
 
 
             //first point is visible
-            visibleArrayInt[(int)y, (int)x] = 1;
+            markVisible((int)y, (int)x);
 
 
 
@@ -892,7 +1013,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
                 float diffY = y - (float)Math.Round(y);
 
                 //grab the snapped height closest to the ray
-                float lerpHeight = zArrayFloat[(int)Math.Round(y), (int)Math.Round(x)];
+                float lerpHeight = heightAt((int)Math.Round(y), (int)Math.Round(x));
 
                 //used to store the height of the closest neighbour
                 float nextHeight;
@@ -905,7 +1026,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
                     if (diffX < 0)
                     {
                         //grab the nextHeight
-                        nextHeight = zArrayFloat[(int)y, (int)x + 1];
+                        nextHeight = heightAt((int)y, (int)x + 1);
                         //interpolated height is original heights + difference in heights * delta 
                         lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffX);
                     }
@@ -913,7 +1034,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
                     if (diffX > 0)
                     {
                         //grab the nextHeight
-                        nextHeight = zArrayFloat[(int)y, (int)x - 1];
+                        nextHeight = heightAt((int)y, (int)x - 1);
                         //interpolated height is original heights + difference in heights * delta 
                         lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffX);
                     }
@@ -921,7 +1042,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
                     if (diffY < 0)
                     {
                         //grab the nextHeight
-                        nextHeight = zArrayFloat[(int)y + 1, (int)x];
+                        nextHeight = heightAt((int)y + 1, (int)x);
                         //interpolated height is original heights + difference in heights * delta 
                         lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffY);
                     }
@@ -929,7 +1050,7 @@ private void calculateR3(int focalX, int focalY, int focalZ, int destinationX, i
                     if (diffY > 0)
                     {
                         //grab the nextHeight
-                        nextHeight = zArrayFloat[(int)y - 1, (int)x];
+                        nextHeight = heightAt((int)y - 1, (int)x);
                         //interpolated height is original heights + difference in heights * delta 
                         lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffY);
                     }
@@ -989,7 +1110,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
 
 
             //first point is visible
-            visibleArrayInt[(int)Math.Round(y), (int)Math.Round(x)] = 1;
+            markVisible((int)Math.Round(y), (int)Math.Round(x));
 
             //calculate distance to the final check point
             float finalDist = (float)Math.Sqrt((destX - focalX) * (destX - focalX) + (destY - focalY) * (destY - focalY));
@@ -1012,7 +1133,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
 
 
                     //grab the snapped height closest to the ray
-                    float lerpHeight = zArrayFloat[(int)y, (int)x];
+                    float lerpHeight = heightAt((int)y, (int)x);
 
                     //used to store the height of the closest neighbour
                     float nextHeight;
@@ -1027,7 +1148,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
                             guessedX = (int)x + 1;
                             guessedY = (int)y;
                             //grab the nextHeight
-                            nextHeight = zArrayFloat[guessedY, guessedX];
+                            nextHeight = heightAt(guessedY, guessedX);
                             //interpolated height is original heights + difference in heights * delta 
                             lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffX);
                         }
@@ -1037,7 +1158,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
                             guessedX = (int)x - 1;
                             guessedY = (int)y;
                             //grab the nextHeight
-                            nextHeight = zArrayFloat[guessedY, guessedX];
+                            nextHeight = heightAt(guessedY, guessedX);
                             //interpolated height is original heights + difference in heights * delta 
                             lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffX);
                         }
@@ -1047,7 +1168,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
                             guessedX = (int)x;
                             guessedY = (int)y + 1;
                             //grab the nextHeight
-                            nextHeight = zArrayFloat[guessedY, guessedX];
+                            nextHeight = heightAt(guessedY, guessedX);
                             //interpolated height is original heights + difference in heights * delta 
                             lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffY);
                         }
@@ -1057,7 +1178,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
                             guessedX = (int)x;
                             guessedY = (int)y - 1;
                             //grab the nextHeight
-                            nextHeight = zArrayFloat[guessedY, guessedX];
+                            nextHeight = heightAt(guessedY, guessedX);
                             //interpolated height is original heights + difference in heights * delta 
                             lerpHeight = lerpHeight + ((nextHeight - lerpHeight) * diffY);
                         }
@@ -1089,6 +1210,7 @@ private void calculateR2(int focalX, int focalY, int focalZ, int destinationX, i
 
         public static void calculateXDRAW(int fx, int fy, int fz)
         {
+            createCPURasters();
 
             int currX = fx;
             int currY = fy;
@@ -1160,14 +1282,14 @@ public static void calculateXDRAW(int fx, int fy, int fz)
             preCalculateDDA(currX, currY, currZ, destX, destY);
 
 
-            visibleArrayInt[currY - 1, currX] = 1;
-            visibleArrayInt[currY + 1, currX] = 1;
-            visibleArrayInt[currY + 1, currX + 1] = 1;
-            visibleArrayInt[currY, currX + 1] = 1;
-            visibleArrayInt[currY - 1, currX + 1] = 1;
-            visibleArrayInt[currY, currX - 1] = 1;
-            visibleArrayInt[currY + 1, currX - 1] = 1;
-            visibleArrayInt[currY - 1, currX - 1] = 1;
+            markVisible(currY - 1, currX);
+            markVisible(currY + 1, currX);
+            markVisible(currY + 1, currX + 1);
+            markVisible(currY, currX + 1);
+            markVisible(currY - 1, currX + 1);
+            markVisible(currY, currX - 1);
+            markVisible(currY + 1, currX - 1);
+            markVisible(currY - 1, currX - 1);
 
 
 
@@ -1206,7 +1328,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2; 
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             // //elevation check
@@ -1247,7 +1369,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2;
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             // //elevation check
@@ -1291,7 +1413,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2; 
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check
@@ -1332,7 +1454,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2; 
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check
@@ -1385,7 +1507,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2;
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check
@@ -1426,7 +1548,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2;
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check
@@ -1470,7 +1592,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2; 
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check
@@ -1511,7 +1633,7 @@ public static void calculateXDRAW(int fx, int fy, int fz)
                             float lerpLOS = (losMax + losMin) / 2; 
 
                             float d = (float)Math.Sqrt((interX - currX) * (interX - currX) + (interY - currY) * (interY - currY));
-                            float e = ((zArrayFloat[interY, interX] - currZ) / d);
+                            float e = ((heightAt(interY, interX) - currZ) / d);
 
 
                             //elevation check